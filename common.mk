@@ -6,8 +6,22 @@ LD = ${TOOLPREFIX}ld
 OBJCOPY = ${TOOLPREFIX}objcopy
 OBJDUMP = ${TOOLPREFIX}objdump
 
+# 内核映射方式
+# 0: 内核使用独立的页表, 每次trap在trampoline里切换satp
+# 1: 内核映射进每个用户页表(无PTE_U), trap时只切换栈, satp在进程切换时切换
+KERNEL_IN_UPGTBL ?= 0
+
+# 时间片长度(时钟中断次数), 用户态进程用完时间片后被抢占
+SCHED_QUANTUM ?= 1
+
+# 1: 启动时各个hart先运行内核自测(见 tlb_test)
+KERNEL_TEST ?= 0
+
 # 编译相关配置
 CFLAGS = -Wall -Werror -O -fno-omit-frame-pointer -ggdb -gdwarf-2
+CFLAGS += -DKERNEL_IN_UPGTBL=$(KERNEL_IN_UPGTBL)
+CFLAGS += -DSCHED_QUANTUM=$(SCHED_QUANTUM)
+CFLAGS += -DKERNEL_TEST=$(KERNEL_TEST)
 CFLAGS += -MD
 CFLAGS += -mcmodel=medany
 CFLAGS += -ffreestanding -fno-common -nostdlib -mno-relax
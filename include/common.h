@@ -20,7 +20,7 @@ typedef enum {false = 0, true = 1} bool;
 #define NULL ((void*)0)
 #endif
 
-#define NCPU 2
-#define NPROC 64
+// 支持的最大hart数量(qemu virt 最多8个), 编号更大的hart在 entry.S 里停住
+#define NCPU 8
 
 #endif
\ No newline at end of file
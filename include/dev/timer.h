@@ -15,10 +15,17 @@ typedef struct timer {
 // 定时器频率（Hz）- RISC-V QEMU 默认为 10MHz
 #define TIMER_FREQ 10000000
 
+// 一个mtime单位对应的纳秒数
+#define TIMER_NS_PER_MTIME (1000000000 / TIMER_FREQ)
+
 void   timer_init();       // 时钟初始化(in M-mode)
 
 void   timer_create();     // 时钟创建
 void   timer_update();     // 时钟更新(ticks++)
 uint64 timer_get_ticks();  // 获取时钟的tick
+bool   timer_tick_fired(); // 软件中断是否来自时钟(并清除标记)
+void   timer_sleep_until(uint64 deadline); // 当前进程睡眠到mtime >= deadline
+void   timer_expire();     // 唤醒本hart上到期的进程
+uint64 timer_mtime();      // 读取mtime计数器
 
 #endif
\ No newline at end of file
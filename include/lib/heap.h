@@ -0,0 +1,29 @@
+#ifndef __HEAP_H__
+#define __HEAP_H__
+
+#include "common.h"
+
+/*
+    左偏堆(leftist heap): 节点嵌在使用者的结构体里, 不需要额外申请内存
+    合并 插入 删除最小值 都是 O(log n)
+
+    比较函数 less(a, b) 返回 a 是否应该排在 b 前面
+    heap_entry(node, type, member) 从节点指针得到所在的结构体
+*/
+
+typedef struct heap_node {
+    struct heap_node* left;
+    struct heap_node* right;
+    int dist;                // 到最近的空子树的距离(右链长度)
+} heap_node_t;
+
+typedef bool (*heap_less_t)(heap_node_t* a, heap_node_t* b);
+
+#define heap_entry(node, type, member) \
+    ((type*)((char*)(node) - (uint64)&((type*)0)->member))
+
+heap_node_t* heap_merge(heap_node_t* a, heap_node_t* b, heap_less_t less);
+heap_node_t* heap_insert(heap_node_t* root, heap_node_t* n, heap_less_t less);
+heap_node_t* heap_pop(heap_node_t* root, heap_less_t less);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef __KMEM_H__
+#define __KMEM_H__
+
+#include "common.h"
+
+/*
+    slab 风格的小对象分配器(建立在 pmem 之上, 使用内核区域的物理页)
+
+    kmem_cache_t 管理一种固定大小的对象, 每个 slab 是一个物理页:
+    页首放 slab_t 头部, 后面切成等大的对象, 对象不会跨页
+    每个CPU有一个对象弹匣, 常见情况下申请和释放不碰cache的锁
+
+    kmalloc/kfree 在一组按2的幂划分的通用cache上实现, 最大 KMALLOC_MAX 字节
+    (2048字节的对象加上页首的slab头部每页只能放一个, 一半的空间被浪费, 更大的内存直接用 pmem_alloc_pages)
+*/
+
+#define KMALLOC_MIN 16
+#define KMALLOC_MAX 1024
+
+typedef struct kmem_cache kmem_cache_t;
+
+void          kmem_init(void);
+kmem_cache_t* kmem_cache_create(char* name, uint32 size);
+void*         kmem_cache_alloc(kmem_cache_t* cache);
+void          kmem_cache_free(kmem_cache_t* cache, void* obj);
+
+void*         kmalloc(uint32 size);
+void          kfree(void* obj);
+
+void          kmem_stat(void);
+
+#endif
@@ -3,10 +3,51 @@
 
 #include "common.h"
 
+/*
+    每个进程的mmap区域组织成一棵AVL树(按begin排序, 区域之间互不重叠)
+    同时按地址顺序串成双向链表(prev/next), 方便顺序遍历
+
+    每个节点记录子树里最大的空闲间隙 max_gap
+    节点的间隙指它和前一个区域之间(限制在 [MMAP_BEGIN, MMAP_END) 内)的空闲范围
+    自动选址时沿着 max_gap 足够大的子树往下找, 复杂度 O(log n)
+
+    相邻且权限和标志都相同的区域会自动合并
+
+    MAP_SHARED 区域的页面在创建时全部分配好, fork时父子进程映射同一组物理页
+    (引用计数+1, 不做写时复制), 其余区域是私有的
+*/
+
+// mmap 标志(与 user/sys.h 保持一致)
+#define MAP_PRIVATE 0x0
+#define MAP_SHARED  0x1
+
+// mprotect 权限(与 user/sys.h 保持一致)
+#define PROT_NONE   0x0
+#define PROT_READ   0x1
+#define PROT_WRITE  0x2
+#define PROT_EXEC   0x4
+
+// madvise 建议(与 user/sys.h 保持一致)
+#define MADV_NORMAL         0
+#define MADV_WILLNEED       3
+#define MADV_DONTNEED       4
+#define MADV_POPULATE_READ  22
+#define MADV_POPULATE_WRITE 23
+
 typedef struct mmap_region {
     uint64 begin;             // 起始地址
     uint32 npages;            // 管理的页面数量
-    struct mmap_region* next; // 链表指针
+    int perm;                 // 页面权限(缺页时按它映射)
+    int flags;                // MAP_SHARED 或 MAP_PRIVATE
+
+    /* 下面的字段由 mmap.c 维护 */
+    struct mmap_region* left;   // 左子树
+    struct mmap_region* right;  // 右子树
+    struct mmap_region* parent; // 父节点
+    struct mmap_region* prev;   // 地址更低的相邻区域
+    struct mmap_region* next;   // 地址更高的相邻区域
+    int height;                 // 子树高度
+    uint64 max_gap;             // 子树里最大的空闲间隙(字节)
 } mmap_region_t;
 
 void           mmap_init();
@@ -14,4 +55,14 @@ mmap_region_t* mmap_region_alloc();
 void           mmap_region_free(mmap_region_t* mmap);
 void           mmap_show_mmaplist();
 
-#endif
\ No newline at end of file
+mmap_region_t* mmap_first(mmap_region_t* root);
+mmap_region_t* mmap_find(mmap_region_t* root, uint64 va);
+bool           mmap_overlap(mmap_region_t* root, uint64 begin, uint64 end);
+uint64         mmap_find_gap(mmap_region_t* root, uint64 len);
+int            mmap_insert(mmap_region_t** root, uint64 begin, uint32 npages, int perm, int flags);
+int            mmap_remove(mmap_region_t** root, uint64 begin, uint64 end);
+int            mmap_protect(mmap_region_t** root, uint64 begin, uint64 end, int perm);
+int            mmap_dup(mmap_region_t* root, mmap_region_t** new_root);
+void           mmap_destroy(mmap_region_t* root);
+
+#endif
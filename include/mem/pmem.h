@@ -6,6 +6,25 @@
 #define PMEM_KERNEL true
 #define PMEM_USER   false
 
+// 伙伴系统的最大阶: 一次最多申请 2^10 个连续页面(4MB)
+#define PMEM_MAX_ORDER 10
+
+/*
+    每个物理页帧的元数据(8字节), 见 pmem.c 中的 pages 数组
+    已分配的页面 refcnt >= 1, pmem_free 只在 refcnt 减到0时才真正释放页面
+    多页块只有首页的元数据有意义
+*/
+typedef struct page {
+    uint32 refcnt;  // 引用计数
+    uint8  flags;   // PG_* 标志
+    uint8  order;   // 伙伴系统使用: 空闲块首页记录 order + 1, 否则为 0
+    uint16 owner;   // 申请这个页面的进程pid (0 表示内核)
+} page_t;
+
+#define PG_KERNEL (1 << 0) // 来自内核区域
+#define PG_ZEROED (1 << 1) // 空闲页且内容已清零
+#define PG_PINNED (1 << 2) // 钉住, 不允许释放
+
 // 来自kernel.ld
 extern char KERNEL_DATA[];
 extern char ALLOC_BEGIN[];
@@ -13,7 +32,16 @@ extern char ALLOC_END[];
 
 void  pmem_init(void);
 void* pmem_alloc(bool in_kernel);
+void* pmem_alloc_nozero(bool in_kernel);
 void  pmem_free(uint64 page, bool in_kernel);
 void  pmem_free_auto(uint64 page);
+void* pmem_alloc_pages(uint32 order, bool in_kernel);
+void* pmem_alloc_pages_nozero(uint32 order, bool in_kernel);
+void  pmem_free_pages(uint64 page, uint32 order, bool in_kernel);
+uint32 pmem_idle(void);
+page_t* pmem_page(uint64 pa);
+void  pmem_get(uint64 page);
+uint32 pmem_refcnt(uint64 page);
+void  pmem_stat(void);
 
-#endif
\ No newline at end of file
+#endif
@@ -8,7 +8,8 @@
     我们使用RISC-V体系结构中的SV39作为虚拟内存的设计规范
 
     satp寄存器: MODE(4) + ASID(16) + PPN(44)
-    MODE控制虚拟内存模式 ASID与Flash刷新有关 PPN存放页表基地址
+    MODE控制虚拟内存模式 ASID标记TLB项属于哪个地址空间 PPN存放页表基地址
+    内核页表使用ASID 0, 每个进程的页表使用自己的ASID(见asid.c)
 
     基础页面 4KB
     
@@ -40,6 +41,10 @@ typedef uint64* pgtbl_t;
 // satp寄存器相关
 #define SATP_SV39 (8L << 60)  // MODE = SV39
 #define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64)pagetable) >> 12)) // 设置MODE和PPN字段
+#define SATP_ASID_SHIFT 44
+#define MAKE_SATP_ASID(pagetable, asid) (MAKE_SATP(pagetable) | ((uint64)(asid) << SATP_ASID_SHIFT))
+
+struct proc;
 
 /*---------------------- in kvm.c -------------------------*/
 
@@ -47,27 +52,57 @@ void   vm_print(pgtbl_t pgtbl);
 pte_t* vm_getpte(pgtbl_t pgtbl, uint64 va, bool alloc);
 uint64 vm_getpa(pgtbl_t pgtbl, uint64 va);
 void   vm_mappages(pgtbl_t pgtbl, uint64 va, uint64 pa, uint64 len, int perm);
-void   vm_unmappages(pgtbl_t pgtbl, uint64 va, uint64 len, bool freeit);
+bool   vm_unmappages(pgtbl_t pgtbl, uint64 va, uint64 len, bool freeit);
 
 pgtbl_t kvm_create(void);
 void    kvm_init();
 void    kvm_inithart();
+uint64  kvm_kstack_alloc();
+void    kvm_kstack_sync();
+bool    kvm_user_conflict(uint64 begin, uint64 end);
+uint64  kvm_user_limit(uint64 va);
+#if KERNEL_IN_UPGTBL
+int     kvm_share(pgtbl_t pgtbl);
+void    kvm_unshare(pgtbl_t pgtbl);
+void    kvm_switch();
+#endif
+
+/*------------------------ in asid.c ----------------------*/
+
+void   asid_init();
+bool   asid_enabled();
+uint64 asid_switch(struct proc* p);
+void   asid_flush_range(struct proc* p, uint64 begin, uint64 end);
+
+/*------------------------ in tlb.c -----------------------*/
+
+void   tlb_init();
+void   tlb_shootdown(struct proc* p, uint64 begin, uint64 end);
+void   tlb_ipi_handler();
+#if KERNEL_TEST
+void   tlb_test();
+#endif
 
 /*------------------------ in uvm.c -----------------------*/
 
 void   uvm_show_mmaplist(mmap_region_t* mmap);
 
 void   uvm_destroy_pgtbl(pgtbl_t pgtbl);
-void uvm_copy_pgtbl(pgtbl_t new, pgtbl_t old, uint64 heap_top, uint32 ustack_pages, mmap_region_t* mmap);
-
-void   uvm_mmap(uint64 begin, uint32 npages, int perm);
-void   uvm_munmap(uint64 begin, uint32 npages);
-
-uint64 uvm_heap_grow(pgtbl_t pgtbl, uint64 heap_top, uint32 len);
-uint64 uvm_heap_ungrow(pgtbl_t pgtbl, uint64 heap_top, uint32 len);
-
-void   uvm_copyin(pgtbl_t pgtbl, uint64 dst, uint64 src, uint32 len);
-void   uvm_copyout(pgtbl_t pgtbl, uint64 dst, uint64 src, uint32 len);
-void   uvm_copyin_str(pgtbl_t pgtbl, uint64 dst, uint64 src, uint32 maxlen);
+int    uvm_copy_pgtbl(pgtbl_t old, pgtbl_t new, uint64 heap_top, uint32 ustack_pages, mmap_region_t* mmap);
+int    uvm_cow_fault(pgtbl_t pgtbl, uint64 va);
+int    uvm_fault(uint64 va, bool write);
+bool   uvm_range_ok(uint64 begin, uint64 end);
+
+int    uvm_mmap(uint64 begin, uint32 npages, int perm, int flags);
+int    uvm_munmap(uint64 begin, uint32 npages);
+int    uvm_mprotect(uint64 begin, uint32 npages, int perm);
+int    uvm_madvise(uint64 begin, uint32 npages, int advice);
+
+uint64 uvm_heap_grow(pgtbl_t pgtbl, uint64 heap_top, uint64 len);
+uint64 uvm_heap_ungrow(pgtbl_t pgtbl, uint64 heap_top, uint64 len);
+
+int    uvm_copyin(pgtbl_t pgtbl, uint64 dst, uint64 src, uint32 len);
+int    uvm_copyout(pgtbl_t pgtbl, uint64 dst, uint64 src, uint32 len);
+int    uvm_copyin_str(pgtbl_t pgtbl, uint64 dst, uint64 src, uint32 maxlen);
 
 #endif
\ No newline at end of file
@@ -35,19 +35,29 @@
 // in both user and kernel space.
 #define TRAMPOLINE (VA_MAX - PGSIZE)
 
-// map kernel stacks beneath the trampoline,
-// each surrounded by invalid guard pages.
-#define KSTACK(p) (TRAMPOLINE - ((p)+1)* 2*PGSIZE)
+// 进程的内核栈映射在PHYSTOP之上(和RAM在同一个1GB里, KERNEL_IN_UPGTBL时随RAM一起共享给用户页表)
+// 每个栈下面有一页不映射的guard page, 栈溢出时触发缺页而不是覆盖相邻的内存
+#define KSTACK_BASE PHYSTOP
+#define KSTACK_END  (KERNEL_BASE + (1ul << 30))
+#define KSTACK(i)   (KSTACK_BASE + ((uint64)(i) * 2 + 1) * PGSIZE)
 
 // User memory layout.
 // Address zero first:
 //   text
 //   original data and bss
-//   fixed-size stack
 //   expandable heap
 //   ...
+//   mmap area [MMAP_BEGIN, MMAP_END)
+//   guard page
+//   stack (grows down on demand, at most USTACK_MAX_PAGES)
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
 
+#define MMAP_END   (VA_MAX - 34 * PGSIZE)
+#define MMAP_BEGIN (MMAP_END - 8096 * PGSIZE)
+
+// 用户栈位于 [MMAP_END + PGSIZE, TRAPFRAME), MMAP_END 处的一页是guard page
+#define USTACK_MAX_PAGES ((TRAPFRAME - MMAP_END) / PGSIZE - 1)
+
 #endif
\ No newline at end of file
@@ -9,10 +9,13 @@ typedef struct cpu {
     int origin;     // 第一次关中断前的状态
     proc_t* proc;   // cpu上运行的进程
     context_t ctx;  // 内核上下文暂存
+    uint64 asid_gen; // 本hart的TLB里的ASID属于哪一代
+    uint64 kstack_gen; // 本hart上次刷新TLB时已经映射了多少个内核栈
 } cpu_t;
 
 int     mycpuid(void);
 cpu_t*  mycpu(void);
+cpu_t*  getcpu(int id);
 proc_t* myproc(void);
 
 #endif
\ No newline at end of file
@@ -2,6 +2,7 @@
 #define __PROC_H__
 
 #include "lib/lock.h"
+#include "lib/heap.h"
 
 // 页表类型定义
 typedef uint64* pgtbl_t;
@@ -73,7 +74,8 @@ typedef struct trapframe {
 /* 
     进程状态集合
     可能的进程状态变换：
-    UNSED -> RUNNABLE 进程初始化
+    UNSED -> USED 进程申请
+    USED -> RUNNABLE 进程初始化完成
     RUNNABLE -> RUNNIGN 进程获得CPU使用权
     RUNNING -> RUNNABLE 进程失去CPU使用权
     RUNNING -> SLEEPING 进程睡眠
@@ -84,12 +86,22 @@ typedef struct trapframe {
 */
 enum proc_state {
     UNUSED,       // 未被使用
-    RUNNABLE,     // 准备就绪
+    USED,         // 已申请, 还在初始化
+    RUNNABLE,     // 准备就绪(在某个hart的运行队列里)
     RUNNING,      // 运行中
     SLEEPING,     // 睡眠等待
     ZOMBIE,       // 濒临死亡
 };
 
+// 时间片长度(时钟中断次数), 可以在编译时指定(见common.mk)
+#ifndef SCHED_QUANTUM
+#define SCHED_QUANTUM 1
+#endif
+
+// nice值的范围, 越小优先级越高(分到的CPU时间越多)
+#define NICE_MIN -20
+#define NICE_MAX 19
+
 // 进程定义
 typedef struct proc {
     
@@ -107,10 +119,25 @@ typedef struct proc {
     uint64 heap_top;         // 用户堆顶(以字节为单位)
     uint64 ustack_pages;     // 用户栈占用的页面数量
     mmap_region_t* mmap;     // 用户可映射区域的起始节点
+    uint64 asid;             // 地址空间标识(代 + ASID)
+    uint64 cpus_ran;         // 运行过这个地址空间的hart(位图, TLB里可能有它的项)
+    uint64 tlb_pending;      // 需要在下次运行前刷新TLB的hart(位图, 见tlb.c)
     trapframe_t* tf;         // 用户态内核态切换时的运行环境暂存空间
 
     uint64 kstack;           // 内核栈的虚拟地址
     context_t ctx;           // 内核态进程上下文
+
+    int last_cpu;            // 上一次在哪个hart运行(-1表示还没运行过)
+    uint32 slice_ticks;      // 当前时间片里在用户态被时钟中断打断的次数
+    uint64 run_ticks;        // 累计在用户态被时钟中断打断的次数
+    uint64 preempt_count;    // 因为时间片用完被抢占的次数
+    heap_node_t rq_node;     // 运行队列(左偏堆)里的节点(持有运行队列的锁才能访问)
+    int nice;                // nice值, 决定调度权重
+    uint64 vruntime;         // 按权重折算的运行时间(mtime单位)
+    uint64 exec_start;       // 这次开始运行的时间(mtime)
+    struct proc* wq_next;    // 等待队列里的后一个进程(持有等待队列的锁才能访问)
+
+    struct proc* next;       // 所有进程构成的链表
 } proc_t;
 
 void     proc_init();                                  // 进程模块初始化
@@ -123,8 +150,13 @@ int      proc_wait(uint64 addr);                       // 等待子进程退出
 void     proc_exit(int exit_state);                    // 进程退出
 void     proc_yield();                                 // 进程放弃CPU
 void     proc_sleep(void* sleep_space, spinlock_t* lk);// 进程睡眠
-void     proc_wakeup(void* sleep_space);               // 进程唤醒
+void     proc_wakeup(void* sleep_space);               // 唤醒所有等待者
+void     proc_wakeup_one(void* sleep_space);           // 唤醒一个等待者
+void     proc_runnable(proc_t* p);                     // 进程放进运行队列(持有p->lk)
 void     proc_sched();                                 // 进程切换到调度器
 void     proc_scheduler();                             // 调度器
+void     proc_tick();                                  // 用户态时钟中断: 计时, 时间片用完时抢占
+void     proc_dump();                                  // 输出所有进程的状态(调试用)
+int      proc_nice(int inc);                           // 调整当前进程的nice值
 void     forkret(void);
 #endif
\ No newline at end of file
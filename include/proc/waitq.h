@@ -0,0 +1,32 @@
+#ifndef __WAITQ_H__
+#define __WAITQ_H__
+
+#include "lib/lock.h"
+#include "proc/proc.h"
+
+/*
+    等待队列: 在同一个对象上睡眠的进程排成一个FIFO队列, 唤醒时只访问队列里的进程
+    一个队列可以被多个channel(睡眠时给出的地址)共用, 唤醒时按channel过滤
+
+    proc_sleep/proc_wakeup 使用的 void* channel 按地址散列到 WAITQ_HASH_SIZE 个队列上
+
+    锁的顺序: p->lk -> wq->lk
+    唤醒者先在 wq->lk 保护下把进程摘出队列, 放开 wq->lk 之后再逐个获取 p->lk 唤醒
+*/
+
+#define WAITQ_HASH_SIZE 64
+
+typedef struct waitq {
+    spinlock_t lk;
+    proc_t* head;
+    proc_t* tail;
+} waitq_t;
+
+void     waitq_init(waitq_t* wq, char* name);
+void     waitq_sleep(waitq_t* wq, void* chan, spinlock_t* lk);
+int      waitq_wake(waitq_t* wq, void* chan, int nr);
+
+void     waitq_hash_init();
+waitq_t* waitq_hash(void* chan);
+
+#endif
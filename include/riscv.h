@@ -37,6 +37,7 @@ static inline void w_mepc(uint64 x)
 
 // Supervisor Status Register, sstatus
 
+#define SSTATUS_SUM (1L << 18) // Supervisor User Memory access
 #define SSTATUS_SPP (1L << 8)  // Previous mode, 1=Supervisor, 0=User
 #define SSTATUS_SPIE (1L << 5) // Supervisor Previous Interrupt Enable
 #define SSTATUS_UPIE (1L << 4) // User Previous Interrupt Enable
@@ -284,6 +285,18 @@ static inline void sfence_vma()
   asm volatile("sfence.vma zero, zero");
 }
 
+// 刷新某个ASID的所有TLB项(不包括全局映射)
+static inline void sfence_vma_asid(uint64 asid)
+{
+  asm volatile("sfence.vma zero, %0" : : "r" (asid) : "memory");
+}
+
+// 刷新某个ASID下某个虚拟地址的TLB项
+static inline void sfence_vma_addr(uint64 va, uint64 asid)
+{
+  asm volatile("sfence.vma %0, %1" : : "r" (va), "r" (asid) : "memory");
+}
+
 // Physical Memory Protection
 static inline void
 w_pmpcfg0(uint64 x)
@@ -306,6 +319,10 @@ w_pmpaddr0(uint64 x)
 #define PG_ROUND_UP(sz)  (((sz)+PGSIZE-1) & ~(PGSIZE-1))
 #define PG_ROUND_DOWN(a) (((a)) & ~(PGSIZE-1))
 
+// 大页(level-1 叶子PTE)映射2MB
+#define MEGA_PGSIZE (1ul << 21)
+#define MEGA_PG_ALIGNED(a) ((((uint64)(a)) & (MEGA_PGSIZE - 1)) == 0)
+
 // 获取虚拟地址中的虚拟页(VPN)信息 占9bit
 #define PXMASK                  0x1FF // 9 bits
 #define VA_SHIFT(level)         (PGSHIFT + 9 * (level))
@@ -324,6 +341,8 @@ w_pmpaddr0(uint64 x)
 #define PTE_G (1 << 5) // global
 #define PTE_A (1 << 6) // accessed
 #define PTE_D (1 << 7) // dirty
+#define PTE_COW (1 << 8) // RSW: copy-on-write (fork后共享的可写页面)
+#define PTE_PROTNONE (1 << 9) // RSW: PROT_NONE页面 (V=0, 物理页仍然属于进程)
 
 // 检查一个PTE是否属于pgtbl
 #define PTE_CHECK(pte) (((pte) & (PTE_R | PTE_W | PTE_X)) == 0)
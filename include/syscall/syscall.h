@@ -11,6 +11,6 @@ void syscall(void);
 
 void arg_uint32(int n, uint32* ip);
 void arg_uint64(int n, uint64* ip);
-void arg_str(int n, char* buf, int maxlen);
+int  arg_str(int n, char* buf, int maxlen);
 
 #endif
\ No newline at end of file
@@ -11,5 +11,9 @@ uint64 sys_fork();
 uint64 sys_wait();
 uint64 sys_exit();
 uint64 sys_sleep();
+uint64 sys_mprotect();
+uint64 sys_madvise();
+uint64 sys_nice();
+uint64 sys_nanosleep();
 
 #endif
\ No newline at end of file
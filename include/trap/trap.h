@@ -20,8 +20,9 @@ void trap_kernel_handler();
 void trap_user_handler();
 void trap_user_return();
 
-// 辅助函数: 外设中断和时钟中断处理
+// 辅助函数: 外设中断 时钟中断 软件中断处理
 void external_interrupt_handler();
 void timer_interrupt_handler();
+bool soft_interrupt_handler();
 
 #endif
\ No newline at end of file
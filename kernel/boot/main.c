@@ -5,6 +5,7 @@
 #include "mem/pmem.h"
 #include "mem/vmem.h"
 #include "mem/mmap.h"
+#include "mem/kmem.h"
 #include "proc/proc.h"
 #include "proc/cpu.h"      // 包含 myproc()
 #include "trap/trap.h"
@@ -19,6 +20,9 @@ void main()
         pmem_init();
         kvm_init();
         kvm_inithart();
+        asid_init();
+        tlb_init();
+        kmem_init();
         mmap_init(); 
         proc_init();         // 初始化进程表
         trap_kernel_init();
@@ -40,6 +44,10 @@ void main()
         plic_inithart();
     }
     
+#if KERNEL_TEST
+    tlb_test();
+#endif
+
     intr_on();
     proc_scheduler();  
 }
@@ -1,6 +1,8 @@
 #include "lib/lock.h"
 #include "lib/print.h"
+#include "lib/heap.h"
 #include "dev/timer.h"
+#include "proc/cpu.h"
 #include "memlayout.h"
 #include "riscv.h"
 
@@ -10,7 +12,7 @@
 extern void timer_vector();
 
 // 每个CPU在时钟中断中需要的临时空间(考虑为什么可以这么写)
-static uint64 mscratch[NCPU][5];
+static uint64 mscratch[NCPU][7];
 
 // 时钟初始化
 // called in start.c
@@ -26,9 +28,13 @@ void timer_init()
     // scratch[0...2]：用于临时存放寄存器值的空间
     // scratch[3]：存放CLINT_MTIMECMP
     // scratch[4]：时钟中断的区间
+    // scratch[5]：时钟中断发生过(M-mode置1, S-mode在timer_tick_fired里清0)
+    // scratch[6]：存放CLINT_MSIP, 核间中断到来时清除
     uint64 *scratch = &mscratch[id][0];
     scratch[3] = CLINT_MTIMECMP(id);
     scratch[4] = INTERVAL;
+    scratch[5] = 0;
+    scratch[6] = CLINT_MSIP(id);
     w_mscratch((uint64)scratch);
 
     // 启动M模式中断处理
@@ -37,8 +43,8 @@ void timer_init()
     // 启动M模式中断
     w_mstatus(r_mstatus() | MSTATUS_MIE);
 
-    // 启动M模式对应的时钟中断
-    w_mie(r_mie() | MIE_MTIE);
+    // 启动M模式对应的时钟中断和软件中断(核间中断)
+    w_mie(r_mie() | MIE_MTIE | MIE_MSIE);
 }
 
 
@@ -47,11 +53,79 @@ void timer_init()
 // 系统时钟
 static timer_t sys_timer;
 
+/*
+    定时睡眠: 每个hart一个按截止时间(mtime)排序的左偏堆
+    进程把截止时间放进当前hart的堆, 然后以事件为channel睡眠(SLEEPING, 不占用CPU)
+    每个hart在自己的时钟中断里唤醒所有到期的进程, 所以精度是一个时钟中断间隔(INTERVAL)
+
+    锁的顺序: 堆的锁 -> 等待队列和进程的锁(见waitq.h)
+*/
+typedef struct timer_event {
+    heap_node_t node;
+    uint64 deadline;         // 截止时间(mtime)
+    bool fired;              // 已经到期
+} timer_event_t;
+
+static struct {
+    spinlock_t lk;
+    heap_node_t* root;
+} deadline_heap[NCPU];
+
+static bool deadline_less(heap_node_t* a, heap_node_t* b)
+{
+    return heap_entry(a, timer_event_t, node)->deadline <
+           heap_entry(b, timer_event_t, node)->deadline;
+}
+
 // 时钟创建(初始化系统时钟)
 void timer_create()
 {
     spinlock_init(&sys_timer.lk, "time");
     sys_timer.ticks = 0;
+
+    for(int i = 0; i < NCPU; i++) {
+        spinlock_init(&deadline_heap[i].lk, "deadline");
+        deadline_heap[i].root = NULL;
+    }
+}
+
+// 当前进程睡眠到mtime不小于deadline
+// 事件放在进程自己的内核栈上, 到期之前进程不会返回
+void timer_sleep_until(uint64 deadline)
+{
+    timer_event_t ev;
+
+    ev.deadline = deadline;
+    ev.fired = false;
+
+    push_off();
+    int id = mycpuid();
+    spinlock_acquire(&deadline_heap[id].lk);
+    pop_off();
+
+    deadline_heap[id].root = heap_insert(deadline_heap[id].root, &ev.node, deadline_less);
+    while(!ev.fired)
+        proc_sleep(&ev, &deadline_heap[id].lk);
+
+    spinlock_release(&deadline_heap[id].lk);
+}
+
+// 唤醒本hart上所有到期的进程(在时钟中断里调用)
+void timer_expire()
+{
+    int id = mycpuid();
+    uint64 now = timer_mtime();
+
+    spinlock_acquire(&deadline_heap[id].lk);
+    while(deadline_heap[id].root != NULL) {
+        timer_event_t* ev = heap_entry(deadline_heap[id].root, timer_event_t, node);
+        if(ev->deadline > now)
+            break;
+        deadline_heap[id].root = heap_pop(deadline_heap[id].root, deadline_less);
+        ev->fired = true;
+        proc_wakeup(ev);
+    }
+    spinlock_release(&deadline_heap[id].lk);
 }
 
 // 时钟更新(ticks++ with lock)
@@ -66,4 +140,18 @@ void timer_update()
 uint64 timer_get_ticks()
 {
     return sys_timer.ticks;
+}
+
+// S-mode软件中断是否(也)由时钟中断引起, 同时清除标记
+// 时钟中断和核间中断都被转发成S-mode软件中断, 靠这个标记区分
+bool timer_tick_fired()
+{
+    return __sync_lock_test_and_set(&mscratch[r_tp()][5], 0) != 0;
+}
+
+// 读取CLINT中的mtime计数器(单位: 1/TIMER_FREQ 秒)
+// 分页开启前后都可以使用(内核页表直接映射了CLINT)
+uint64 timer_mtime()
+{
+    return *(volatile uint64*)CLINT_MTIME;
 }
\ No newline at end of file
@@ -2,6 +2,10 @@
 
 #include "memlayout.h"
 #include "lib/lock.h"
+#include "proc/proc.h"
+#include "mem/pmem.h"
+
+#define C(x) ((x) - '@') // Control-x
 
 // the UART control registers.
 // some have different meanings for
@@ -88,6 +92,12 @@ void uart_intr(void)
   {
     int c = uart_getc_sync();
     if(c == -1) break;
+    if(c == C('P')) {
+      // Ctrl-P: 输出进程状态和物理内存的使用情况
+      proc_dump();
+      pmem_stat();
+      continue;
+    }
     uart_putc_sync(c);
   }
 }
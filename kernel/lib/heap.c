@@ -0,0 +1,46 @@
+#include "common.h"
+#include "lib/heap.h"
+
+static int node_dist(heap_node_t* n)
+{
+    return n ? n->dist : 0;
+}
+
+// 合并两个堆, 返回新的根
+// 沿右链向下合并, 然后让每个节点左子树的dist不小于右子树
+heap_node_t* heap_merge(heap_node_t* a, heap_node_t* b, heap_less_t less)
+{
+    if(a == NULL) return b;
+    if(b == NULL) return a;
+
+    if(less(b, a)) {
+        heap_node_t* t = a;
+        a = b;
+        b = t;
+    }
+
+    a->right = heap_merge(a->right, b, less);
+    if(node_dist(a->left) < node_dist(a->right)) {
+        heap_node_t* t = a->left;
+        a->left = a->right;
+        a->right = t;
+    }
+    a->dist = node_dist(a->right) + 1;
+    return a;
+}
+
+// 插入节点n, 返回新的根
+heap_node_t* heap_insert(heap_node_t* root, heap_node_t* n, heap_less_t less)
+{
+    n->left = n->right = NULL;
+    n->dist = 1;
+    return heap_merge(root, n, less);
+}
+
+// 删除最小的节点(也就是root), 返回新的根
+heap_node_t* heap_pop(heap_node_t* root, heap_less_t less)
+{
+    heap_node_t* rest = heap_merge(root->left, root->right, less);
+    root->left = root->right = NULL;
+    return rest;
+}
@@ -0,0 +1,114 @@
+// address space identifier allocation
+
+#include "mem/vmem.h"
+#include "proc/cpu.h"
+#include "lib/print.h"
+#include "lib/lock.h"
+#include "riscv.h"
+#include "common.h"
+
+/*
+    每个用户地址空间使用一个ASID, TLB项按ASID区分, 切换页表时不再需要刷新整个TLB
+    内核页表使用ASID 0, 内核的RAM映射和trampoline带PTE_G, 在所有ASID下共享
+
+    p->asid 的低16位是ASID, 高位是分配时的代(generation)
+    ASID用完时代数+1从头分配, 上一代分配出去的ASID全部作废(进程下次返回用户态时重新分配)
+    每个hart第一次使用新一代的ASID之前刷新整个TLB, 之后只需要按ASID刷新
+
+    同一代里ASID不会重复分配, 所以进程退出时不需要刷新
+    其他hart上的过期TLB项由 tlb.c 处理: 没在运行这个地址空间的hart只记在 p->tlb_pending 里,
+    进程回到这个hart时按ASID刷新一次
+*/
+
+#define ASID_GEN_SHIFT 16
+#define ASID_MASK      ((1ul << ASID_GEN_SHIFT) - 1)
+
+// 一次刷新超过这么多页就直接按ASID整体刷新
+#define ASID_FLUSH_PAGES 32
+
+static spinlock_t asid_lk;
+static uint64 asid_gen = 1;  // 当前的代(从1开始, 0代表从未分配)
+static uint64 asid_next = 1; // 下一个可分配的ASID
+static uint64 asid_max = 0;  // 硬件支持的最大ASID, 0表示不支持ASID
+
+// 探测硬件实现的ASID位数(向satp的ASID字段写全1再读回)
+// 在hart-0开启分页之后调用
+void asid_init()
+{
+    spinlock_init(&asid_lk, "asid");
+
+    uint64 satp = r_satp();
+    w_satp(satp | (ASID_MASK << SATP_ASID_SHIFT));
+    asid_max = (r_satp() >> SATP_ASID_SHIFT) & ASID_MASK;
+    w_satp(satp);
+    sfence_vma();
+
+    printf("asid_init: %d asids supported\n", (int)asid_max);
+}
+
+// 是否支持ASID
+bool asid_enabled()
+{
+    return asid_max != 0;
+}
+
+// 进程p即将在本hart返回用户态(关中断状态下调用)
+// 保证p持有当前代的ASID, 必要时刷新本hart的TLB, 返回要写入satp的值
+uint64 asid_switch(proc_t* p)
+{
+    cpu_t* c = mycpu();
+    int id = mycpuid();
+    uint64 gen;
+
+    if(asid_max == 0) {
+        // 不支持ASID: 用户和内核共用ASID 0, 只能整体刷新
+        // 在trampoline里切换satp时, 刷新紧跟在写入satp之后(见 trampoline.S)
+        __sync_fetch_and_or(&p->cpus_ran, 1ul << id);
+#if KERNEL_IN_UPGTBL
+        sfence_vma();
+#endif
+        return MAKE_SATP(p->pgtbl);
+    }
+
+    spinlock_acquire(&asid_lk);
+    if((p->asid >> ASID_GEN_SHIFT) != asid_gen) {
+        if(asid_next > asid_max) {
+            asid_gen++;
+            asid_next = 1;
+        }
+        p->asid = (asid_gen << ASID_GEN_SHIFT) | asid_next++;
+    }
+    gen = asid_gen;
+    spinlock_release(&asid_lk);
+
+    // 先登记再检查pending, 和 tlb_shootdown 的顺序相反, 保证不会漏掉刷新
+    __sync_fetch_and_or(&p->cpus_ran, 1ul << id);
+    uint64 pending = __sync_fetch_and_and(&p->tlb_pending, ~(1ul << id));
+
+    if(c->asid_gen != gen) {
+        // 本hart第一次使用这一代的ASID
+        sfence_vma();
+        c->asid_gen = gen;
+    } else if(pending & (1ul << id)) {
+        // 进程不在本hart运行期间修改过页表, 本hart上可能有它的过期TLB项
+        sfence_vma_asid(p->asid & ASID_MASK);
+    }
+
+    return MAKE_SATP_ASID(p->pgtbl, p->asid & ASID_MASK);
+}
+
+// p的页表中 [begin, end) 的映射被修改或删除后刷新本hart的TLB
+// 按页刷新(sfence.vma va, asid)只保证刷新叶子PTE, 释放了页表页时调用者要传入整个用户空间
+void asid_flush_range(proc_t* p, uint64 begin, uint64 end)
+{
+    uint64 asid = p->asid & ASID_MASK;
+
+    if(asid_max == 0) {
+        sfence_vma();
+    } else if((end - begin) / PGSIZE > ASID_FLUSH_PAGES) {
+        sfence_vma_asid(asid);
+    } else {
+        for(uint64 va = PG_ROUND_DOWN(begin); va < end; va += PGSIZE)
+            sfence_vma_addr(va, asid);
+    }
+}
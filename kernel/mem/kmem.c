@@ -0,0 +1,303 @@
+// slab allocator for small kernel objects
+
+#include "mem/pmem.h"
+#include "mem/kmem.h"
+#include "proc/cpu.h"
+#include "lib/print.h"
+#include "lib/lock.h"
+#include "lib/str.h"
+#include "common.h"
+#include "riscv.h"
+
+#define KMEM_MAX_CACHES 32  // 最多支持的cache种类数
+#define KMEM_MAG_SIZE   16  // 每个CPU弹匣的容量
+#define KMEM_MAG_BATCH  8   // 弹匣一次批量补充/归还的对象数
+#define KMEM_MAX_EMPTY  2   // 每个cache最多保留的空slab数, 多余的还给pmem
+
+// 空闲对象节点(存放在空闲对象本身里)
+typedef struct kmem_obj {
+    struct kmem_obj* next;
+} kmem_obj_t;
+
+// slab头部, 位于slab页的开头
+typedef struct slab {
+    kmem_cache_t* cache;   // 所属cache
+    struct slab* next;     // 所在链表(partial/full/empty)的指针
+    struct slab* prev;
+    kmem_obj_t* freelist;  // 空闲对象链
+    uint32 inuse;          // 已分配出去的对象数
+} slab_t;
+
+// 每个CPU的对象弹匣
+typedef struct kmem_mag {
+    uint32 count;
+    void* objs[KMEM_MAG_SIZE];
+} __attribute__((aligned(64))) kmem_mag_t;
+
+struct kmem_cache {
+    char* name;            // 名字(for debug)
+    uint32 size;           // 对象大小(已对齐)
+    uint32 offset;         // 第一个对象在slab页内的偏移
+    uint32 per_slab;       // 每个slab的对象数
+
+    spinlock_t lk;         // 保护下面的slab链表和统计信息
+    slab_t partial;        // 部分使用的slab(哨兵)
+    slab_t full;           // 用满的slab(哨兵)
+    slab_t empty;          // 完全空闲的slab(哨兵)
+    uint32 nempty;         // 空slab数量
+    uint32 nslabs;         // slab总数
+    uint64 inuse;          // 在slab之外的对象数(包括躺在弹匣里的)
+
+    kmem_mag_t mag[NCPU];  // 每个CPU的弹匣
+};
+
+static kmem_cache_t caches[KMEM_MAX_CACHES];
+static int ncaches;
+static spinlock_t caches_lk;
+
+// kmalloc 使用的通用cache: 16, 32, ..., KMALLOC_MAX
+#define KMALLOC_NCLASS 7
+static kmem_cache_t* kmalloc_caches[KMALLOC_NCLASS];
+static char* kmalloc_names[KMALLOC_NCLASS] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024",
+};
+
+/*---------------------------- slab 链表操作 ----------------------------*/
+
+static void slab_list_init(slab_t* head)
+{
+    head->next = head;
+    head->prev = head;
+}
+
+static void slab_list_remove(slab_t* s)
+{
+    s->prev->next = s->next;
+    s->next->prev = s->prev;
+}
+
+static void slab_list_push(slab_t* head, slab_t* s)
+{
+    s->next = head->next;
+    s->prev = head;
+    head->next->prev = s;
+    head->next = s;
+}
+
+static bool slab_list_empty(slab_t* head)
+{
+    return head->next == head;
+}
+
+/*------------------------ cache核心(持有cache->lk) ------------------------*/
+
+// 申请一个新的slab页并切成对象
+// 失败返回NULL
+static slab_t* slab_create(kmem_cache_t* cache)
+{
+    slab_t* s = (slab_t*)pmem_alloc_pages(0, PMEM_KERNEL);
+    if(s == NULL)
+        return NULL;
+
+    s->cache = cache;
+    s->inuse = 0;
+    s->freelist = NULL;
+    for(int i = cache->per_slab - 1; i >= 0; i--) {
+        kmem_obj_t* obj = (kmem_obj_t*)((uint64)s + cache->offset + i * cache->size);
+        obj->next = s->freelist;
+        s->freelist = obj;
+    }
+
+    cache->nslabs++;
+    return s;
+}
+
+// 从slab里取一个对象
+// 失败返回NULL
+static void* cache_take(kmem_cache_t* cache)
+{
+    slab_t* s;
+
+    if(!slab_list_empty(&cache->partial)) {
+        s = cache->partial.next;
+        slab_list_remove(s);
+    } else if(!slab_list_empty(&cache->empty)) {
+        s = cache->empty.next;
+        slab_list_remove(s);
+        cache->nempty--;
+    } else {
+        s = slab_create(cache);
+        if(s == NULL)
+            return NULL;
+    }
+
+    kmem_obj_t* obj = s->freelist;
+    s->freelist = obj->next;
+    s->inuse++;
+    cache->inuse++;
+
+    slab_list_push(s->inuse == cache->per_slab ? &cache->full : &cache->partial, s);
+    return obj;
+}
+
+// 把一个对象还给它所在的slab
+static void cache_put(kmem_cache_t* cache, void* ptr)
+{
+    slab_t* s = (slab_t*)PG_ROUND_DOWN((uint64)ptr);
+    assert(s->cache == cache, "kmem: object freed to wrong cache");
+
+    kmem_obj_t* obj = (kmem_obj_t*)ptr;
+    obj->next = s->freelist;
+    s->freelist = obj;
+    s->inuse--;
+    cache->inuse--;
+
+    slab_list_remove(s);
+    if(s->inuse > 0) {
+        slab_list_push(&cache->partial, s);
+    } else if(cache->nempty < KMEM_MAX_EMPTY) {
+        slab_list_push(&cache->empty, s);
+        cache->nempty++;
+    } else {
+        cache->nslabs--;
+        pmem_free((uint64)s, PMEM_KERNEL);
+    }
+}
+
+/*------------------------------ 对外接口 ------------------------------*/
+
+// 初始化cache表和kmalloc的通用cache
+void kmem_init(void)
+{
+    spinlock_init(&caches_lk, "kmem_caches");
+    ncaches = 0;
+
+    for(int i = 0; i < KMALLOC_NCLASS; i++)
+        kmalloc_caches[i] = kmem_cache_create(kmalloc_names[i], KMALLOC_MIN << i);
+
+    printf("kmem_init: %d kmalloc size classes up to %d bytes\n", KMALLOC_NCLASS, KMALLOC_MAX);
+}
+
+// 创建一个管理 size 字节对象的cache
+// 失败则panic
+kmem_cache_t* kmem_cache_create(char* name, uint32 size)
+{
+    // 对象至少能放下空闲链指针, 按8字节对齐; 16字节以上的对象按16字节对齐
+    uint32 align = size >= 16 ? 16 : 8;
+    size = (size + align - 1) & ~(align - 1);
+    uint32 offset = (sizeof(slab_t) + align - 1) & ~(align - 1);
+
+    if(size == 0 || offset + size > PGSIZE)
+        panic("kmem_cache_create: bad object size");
+
+    spinlock_acquire(&caches_lk);
+    if(ncaches >= KMEM_MAX_CACHES) {
+        spinlock_release(&caches_lk);
+        panic("kmem_cache_create: too many caches");
+    }
+    kmem_cache_t* cache = &caches[ncaches++];
+    spinlock_release(&caches_lk);
+
+    memset(cache, 0, sizeof(kmem_cache_t));
+    cache->name = name;
+    cache->size = size;
+    cache->offset = offset;
+    cache->per_slab = (PGSIZE - offset) / size;
+    spinlock_init(&cache->lk, name);
+    slab_list_init(&cache->partial);
+    slab_list_init(&cache->full);
+    slab_list_init(&cache->empty);
+
+    return cache;
+}
+
+// 申请一个清零的对象
+// 失败返回NULL
+void* kmem_cache_alloc(kmem_cache_t* cache)
+{
+    void* obj = NULL;
+
+    push_off();
+    kmem_mag_t* mag = &cache->mag[mycpuid()];
+
+    // 弹匣空了就从slab批量补充
+    if(mag->count == 0) {
+        spinlock_acquire(&cache->lk);
+        while(mag->count < KMEM_MAG_BATCH) {
+            void* tmp = cache_take(cache);
+            if(tmp == NULL)
+                break;
+            mag->objs[mag->count++] = tmp;
+        }
+        spinlock_release(&cache->lk);
+    }
+
+    if(mag->count > 0)
+        obj = mag->objs[--mag->count];
+
+    pop_off();
+
+    if(obj != NULL)
+        memset(obj, 0, cache->size);
+    return obj;
+}
+
+// 释放一个对象
+void kmem_cache_free(kmem_cache_t* cache, void* obj)
+{
+    if(obj == NULL)
+        return;
+
+    push_off();
+    kmem_mag_t* mag = &cache->mag[mycpuid()];
+
+    // 弹匣满了就批量还给slab
+    if(mag->count == KMEM_MAG_SIZE) {
+        spinlock_acquire(&cache->lk);
+        for(int i = 0; i < KMEM_MAG_BATCH; i++)
+            cache_put(cache, mag->objs[--mag->count]);
+        spinlock_release(&cache->lk);
+    }
+
+    mag->objs[mag->count++] = obj;
+
+    pop_off();
+}
+
+// 申请 size 字节的清零内存(size <= KMALLOC_MAX)
+// 失败返回NULL
+void* kmalloc(uint32 size)
+{
+    if(size == 0 || size > KMALLOC_MAX)
+        return NULL;
+
+    int i = 0;
+    while((KMALLOC_MIN << i) < size)
+        i++;
+    return kmem_cache_alloc(kmalloc_caches[i]);
+}
+
+// 释放 kmalloc 得到的内存
+void kfree(void* obj)
+{
+    if(obj == NULL)
+        return;
+
+    slab_t* s = (slab_t*)PG_ROUND_DOWN((uint64)obj);
+    kmem_cache_free(s->cache, obj);
+}
+
+// 输出所有cache的使用情况
+// for debug
+void kmem_stat(void)
+{
+    for(int i = 0; i < ncaches; i++) {
+        kmem_cache_t* cache = &caches[i];
+        spinlock_acquire(&cache->lk);
+        printf("kmem_stat: %s size=%d per_slab=%d slabs=%d empty=%d inuse=%d\n",
+               cache->name, cache->size, cache->per_slab,
+               cache->nslabs, cache->nempty, (int)cache->inuse);
+        spinlock_release(&cache->lk);
+    }
+}
@@ -2,7 +2,9 @@
 
 #include "mem/pmem.h"
 #include "mem/vmem.h"
+#include "proc/cpu.h"
 #include "lib/print.h"
+#include "lib/lock.h"
 #include "lib/str.h"
 #include "riscv.h"
 #include "memlayout.h"
@@ -12,21 +14,40 @@ extern char trampoline[]; // in trampoline.S
 
 static pgtbl_t kernel_pgtbl; // 内核页表
 
+// 内核栈槽位: KSTACK(0), KSTACK(1) ... 分配出去之后不再回收(进程控制块也不回收)
+static spinlock_t kstack_lk;
+static int kstack_next;             // 下一个空闲槽位
+static volatile uint64 kstack_gen;  // 已经映射的内核栈数量
 
-// 根据pagetable,找到va对应的pte
+// 内核使用的MMIO区域
+static struct {
+    uint64 base;
+    uint64 size;
+} kernel_mmio[] = {
+    { UART_BASE,  PGSIZE },
+    { CLINT_BASE, 0x10000 },
+    { PLIC_BASE,  0x400000 },
+};
+
+#define NMMIO (sizeof(kernel_mmio) / sizeof(kernel_mmio[0]))
+
+
+// 根据pagetable,找到va在指定level的pte
 // 若设置alloc=true 则在PTE无效时尝试申请一个物理页
+// 中途遇到大页叶子则直接返回它(此时返回的PTE的level高于要求的level)
 // 成功返回PTE, 失败返回NULL
-// 提示：使用 VA_TO_VPN PTE_TO_PA PA_TO_PTE
-pte_t* vm_getpte(pgtbl_t pgtbl, uint64 va, bool alloc)
+static pte_t* getpte_level(pgtbl_t pgtbl, uint64 va, bool alloc, int target)
 {
-    pgtbl_t current_pgtbl = pgtbl;  // ← 使用局部变量
+    pgtbl_t current_pgtbl = pgtbl;
     
-    // 三级页表遍历
-    for(int level = 2; level > 0; level--) {
+    for(int level = 2; level > target; level--) {
         uint64 vpn = VA_TO_VPN(va, level);
         pte_t* pte = &current_pgtbl[vpn];
         
         if((*pte) & PTE_V) {
+            // 大页叶子: 没有下一级页表
+            if(!PTE_CHECK(*pte))
+                return pte;
             // PTE有效，获取下一级页表
             current_pgtbl = (pgtbl_t)PTE_TO_PA(*pte);
         } else {
@@ -34,26 +55,67 @@ pte_t* vm_getpte(pgtbl_t pgtbl, uint64 va, bool alloc)
             if(!alloc) {
                 return NULL;
             }
-            // 申请新的页表页
-            current_pgtbl = (pgtbl_t)pmem_alloc(true);
+            // 申请新的页表页(内存不足时返回NULL, 由调用者决定是否panic)
+            current_pgtbl = (pgtbl_t)pmem_alloc_pages(0, true);
             if(current_pgtbl == NULL) {
                 return NULL;
             }
-            memset(current_pgtbl, 0, PGSIZE);  // ← 添加这行：清零新页表
             // 设置PTE指向新页表
             *pte = PA_TO_PTE((uint64)current_pgtbl) | PTE_V;
         }
     }
     
-    // 返回level 0的PTE
-    uint64 vpn = VA_TO_VPN(va, 0);
-    return &current_pgtbl[vpn];
+    return &current_pgtbl[VA_TO_VPN(va, target)];
+}
+
+// 把一个大页叶子拆成512个普通页叶子(权限不变)
+static void split_megapage(pte_t* pte)
+{
+    pgtbl_t pgtbl_0 = (pgtbl_t)pmem_alloc(true);
+    uint64 pa = PTE_TO_PA(*pte);
+    int flags = PTE_FLAGS(*pte);
+
+    for(int i = 0; i < PGSIZE / sizeof(pte_t); i++)
+        pgtbl_0[i] = PA_TO_PTE(pa + (uint64)i * PGSIZE) | flags;
+    *pte = PA_TO_PTE((uint64)pgtbl_0) | PTE_V;
+}
+
+// 根据pagetable,找到va对应的pte
+// 若设置alloc=true 则在PTE无效时尝试申请一个物理页
+// 如果va落在大页里, 返回的是level-1的大页叶子
+// 成功返回PTE, 失败返回NULL
+// 提示：使用 VA_TO_VPN PTE_TO_PA PA_TO_PTE
+pte_t* vm_getpte(pgtbl_t pgtbl, uint64 va, bool alloc)
+{
+    return getpte_level(pgtbl, va, alloc, 0);
+}
+
+// 查询va对应的物理地址(包括页内偏移), 未映射返回0
+uint64 vm_getpa(pgtbl_t pgtbl, uint64 va)
+{
+    if(va >= VA_MAX)
+        return 0;
+
+    // 逐级查找, 记录叶子所在的level以计算偏移
+    pgtbl_t current_pgtbl = pgtbl;
+    for(int level = 2; level >= 0; level--) {
+        pte_t pte = current_pgtbl[VA_TO_VPN(va, level)];
+        if(!(pte & PTE_V))
+            return 0;
+        if(!PTE_CHECK(pte))
+            return PTE_TO_PA(pte) + (va & ((1ul << VA_SHIFT(level)) - 1));
+        current_pgtbl = (pgtbl_t)PTE_TO_PA(pte);
+    }
+    return 0;
 }
 
 // 在pgtbl中建立 [va, va + len) -> [pa, pa + len) 的映射
 // 本质是找到va在页表对应位置的pte并修改它
 // 检查: va pa 应当是 page-aligned, len(字节数) > 0, va + len <= VA_MAX
 // 注意: perm 应该如何使用
+// 内核映射(不含PTE_U)中 va pa 都按2MB对齐且剩余长度足够的部分使用大页
+// 用户映射总是使用普通页, 因为之后会按页修改和释放
+// 每个低级页表只查找一次, 然后连续填写其中的PTE
 void vm_mappages(pgtbl_t pgtbl, uint64 va, uint64 pa, uint64 len, int perm)
 {
     // 参数检查
@@ -62,82 +124,142 @@ void vm_mappages(pgtbl_t pgtbl, uint64 va, uint64 pa, uint64 len, int perm)
     assert(len > 0, "vm_mappages: len <= 0");
     assert(va + len <= VA_MAX, "vm_mappages: va + len > VA_MAX");
     
-    uint64 va_start = va;
+    uint64 va_current = va;
     uint64 va_end = va + len;
     uint64 pa_current = pa;
+    pte_t* pte;
     
-    for(uint64 va_current = va_start; va_current < va_end; va_current += PGSIZE, pa_current += PGSIZE) {
-        pte_t* pte = vm_getpte(pgtbl, va_current, true);
+    while(va_current < va_end) {
+        if(!(perm & PTE_U) && MEGA_PG_ALIGNED(va_current) && MEGA_PG_ALIGNED(pa_current) &&
+           va_end - va_current >= MEGA_PGSIZE) {
+            pte = getpte_level(pgtbl, va_current, true, 1);
+            assert(pte != NULL, "vm_mappages: getpte failed");
+            // 这里还没有下一级页表(之前没有映射过普通页)才能使用大页
+            if(!((*pte) & PTE_V)) {
+                *pte = PA_TO_PTE(pa_current) | perm | PTE_V;
+                va_current += MEGA_PGSIZE;
+                pa_current += MEGA_PGSIZE;
+                continue;
+            }
+        }
+
+        // 找到va_current所在的低级页表, 一直填到这个页表的末尾或区间结束
+        pte = vm_getpte(pgtbl, va_current, true);
         assert(pte != NULL, "vm_mappages: vm_getpte failed");
-        assert(!((*pte) & PTE_V), "vm_mappages: remap");
-        
-        // 设置PTE：物理地址 + 权限标志 + V标志
-        *pte = PA_TO_PTE(pa_current) | perm | PTE_V;
+        uint64 n = PGSIZE / sizeof(pte_t) - VA_TO_VPN(va_current, 0);
+        if(n > (va_end - va_current) / PGSIZE)
+            n = (va_end - va_current) / PGSIZE;
+
+        for(uint64 i = 0; i < n; i++) {
+            assert(!(pte[i] & (PTE_V | PTE_PROTNONE)), "vm_mappages: remap");
+            // 设置PTE：物理地址 + 权限标志 + V标志
+            pte[i] = PA_TO_PTE(pa_current) | perm | PTE_V;
+            va_current += PGSIZE;
+            pa_current += PGSIZE;
+        }
+    }
+}
+
+// 页表页中是否已经没有有效的PTE(PROT_NONE的页面也算)
+static bool pgtbl_empty(pgtbl_t tbl)
+{
+    for(int i = 0; i < PGSIZE / sizeof(pte_t); i++)
+        if(tbl[i] & (PTE_V | PTE_PROTNONE))
+            return false;
+    return true;
+}
+
+// 在level级页表tbl中解除 [va, end) 的映射
+// 无效的表项直接跳过它覆盖的整个范围, 变空的下级页表会被释放
+// 释放了页表页返回true
+static bool unmap_level(pgtbl_t tbl, int level, uint64 va, uint64 end, bool freeit)
+{
+    uint64 size = 1ul << VA_SHIFT(level);
+    uint64 next;
+    bool freed = false;
+
+    for(uint64 idx = VA_TO_VPN(va, level); idx < PGSIZE / sizeof(pte_t) && va < end; idx++, va = next) {
+        pte_t* pte = &tbl[idx];
+        next = (va & ~(size - 1)) + size;
+
+        if(!((*pte) & (PTE_V | PTE_PROTNONE)))
+            continue;
+
+        // PROT_NONE的页面没有RWX, 但它是叶子(只出现在最低级)
+        if(!PTE_CHECK(*pte) || ((*pte) & PTE_PROTNONE)) {
+            // 叶子: 完整覆盖则直接清除, 部分覆盖的大页先拆开
+            if(level == 0 || ((va & (size - 1)) == 0 && next <= end)) {
+                if(freeit) {
+                    assert(level == 0, "vm_unmappages: free megapage");
+                    pmem_free(PTE_TO_PA(*pte), false);
+                }
+                // 清除PTE
+                *pte = 0;
+                continue;
+            }
+            assert(level == 1, "vm_unmappages: split gigapage");
+            split_megapage(pte);
+        }
+
+        pgtbl_t child = (pgtbl_t)PTE_TO_PA(*pte);
+        if(unmap_level(child, level - 1, va, next < end ? next : end, freeit))
+            freed = true;
+        if(pgtbl_empty(child)) {
+            *pte = 0;
+            pmem_free((uint64)child, true);
+            freed = true;
+        }
     }
+    return freed;
 }
 
 // 解除pgtbl中[va, va+len)区域的映射
 // 如果freeit == true则释放对应物理页, 默认是用户的物理页
-void vm_unmappages(pgtbl_t pgtbl, uint64 va, uint64 len, bool freeit)
+// 大页整体落在区间内则直接清除, 否则先拆成普通页再处理
+// (大页只用于内核映射, 不会和freeit一起使用)
+// 没有映射的子树整体跳过, 变空的页表页随之释放
+// 返回是否释放了页表页: 这时只按地址刷新TLB是不够的(sfence.vma va只保证刷新叶子PTE,
+// 中间级的缓存可能还指向被释放的页表页), 调用者需要整体刷新
+bool vm_unmappages(pgtbl_t pgtbl, uint64 va, uint64 len, bool freeit)
 {
     assert(va % PGSIZE == 0, "vm_unmappages: va not aligned");
     assert(len > 0, "vm_unmappages: len <= 0");
+    assert(va + len <= VA_MAX, "vm_unmappages: va + len > VA_MAX");
     
-    uint64 va_start = va;
-    uint64 va_end = va + len;
-    
-    for(uint64 va_current = va_start; va_current < va_end; va_current += PGSIZE) {
-        pte_t* pte = vm_getpte(pgtbl, va_current, false);
-        if(pte == NULL || !((*pte) & PTE_V)) {
-            continue;
-        }
-        
-        // 如果需要释放物理页
-        if(freeit) {
-            uint64 pa = PTE_TO_PA(*pte);
-            pmem_free(pa, false);
-        }
-        
-        // 清除PTE
-        *pte = 0;
-    }
+    return unmap_level(pgtbl, 2, va, va + len, freeit);
 }
 
 // 填充kernel_pgtbl
-// 完成 UART CLINT PLIC 内核代码区 内核数据区 可分配区域 trampoline kstack 的映射
+// 完成 UART CLINT PLIC 内核代码区 内核数据区 可分配区域 trampoline 的映射
 void kvm_init()
 {
     // 申请内核页表
     kernel_pgtbl = (pgtbl_t)pmem_alloc(true);
     
-    // UART 映射 (RW)
-    vm_mappages(kernel_pgtbl, UART_BASE, UART_BASE, PGSIZE, PTE_R | PTE_W);
-    
-    // CLINT 映射 (RW)
-    vm_mappages(kernel_pgtbl, CLINT_BASE, CLINT_BASE, 0x10000, PTE_R | PTE_W);
+    // UART CLINT PLIC 映射 (RW)
+    for(int i = 0; i < NMMIO; i++)
+        vm_mappages(kernel_pgtbl, kernel_mmio[i].base, kernel_mmio[i].base,
+                    kernel_mmio[i].size, PTE_R | PTE_W);
     
-    // PLIC 映射 (RW)
-    vm_mappages(kernel_pgtbl, PLIC_BASE, PLIC_BASE, 0x400000, PTE_R | PTE_W);
+    // 下面三段是全局映射(PTE_G), 在所有ASID下有效, 用户地址不能与它们重叠
     
     // 内核代码区和数据区映射 (RWX)
     // 从KERNEL_BASE到KERNEL_DATA是代码区，从KERNEL_DATA到ALLOC_BEGIN是数据区
     vm_mappages(kernel_pgtbl, KERNEL_BASE, KERNEL_BASE, 
-                (uint64)ALLOC_BEGIN - KERNEL_BASE, PTE_R | PTE_W | PTE_X);
+                (uint64)ALLOC_BEGIN - KERNEL_BASE, PTE_R | PTE_W | PTE_X | PTE_G);
     
     // 可分配区域映射 (RW)
+    // 到下一个2MB边界之前用普通页, 之后全部是大页
     vm_mappages(kernel_pgtbl, (uint64)ALLOC_BEGIN, (uint64)ALLOC_BEGIN,
-                (uint64)ALLOC_END - (uint64)ALLOC_BEGIN, PTE_R | PTE_W);
+                (uint64)ALLOC_END - (uint64)ALLOC_BEGIN, PTE_R | PTE_W | PTE_G);
     
     // trampoline 映射 (RX)
-    vm_mappages(kernel_pgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
+    vm_mappages(kernel_pgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X | PTE_G);
     
-    // kstack 映射 - 这里假设最多支持8个CPU，每个CPU一个栈
-    // 每个栈大小为PGSIZE，栈之间有guard page
-    for(int i = 0; i < 8; i++) {
-        uint64 kstack_va = KSTACK(i);
-        uint64 kstack_pa = (uint64)pmem_alloc(true);
-        vm_mappages(kernel_pgtbl, kstack_va, kstack_pa, PGSIZE, PTE_R | PTE_W);
-    }
+    // 进程的内核栈在创建进程时由 kvm_kstack_alloc 映射
+    spinlock_init(&kstack_lk, "kstack");
+    kstack_next = 0;
+    kstack_gen = 0;
     
     printf("kvm_init: kernel page table initialized\n");
 }
@@ -147,8 +269,135 @@ void kvm_inithart()
 {
     w_satp(MAKE_SATP(kernel_pgtbl));
     sfence_vma();
+    mycpu()->kstack_gen = kstack_gen;
+}
+
+// 申请一个内核栈: 申请一页物理内存映射到下一个空闲槽位, 它下面的一页留空作为guard page
+// 成功返回栈的最低地址, 槽位或内存用完返回0
+uint64 kvm_kstack_alloc()
+{
+    uint64 va = 0;
+
+    spinlock_acquire(&kstack_lk);
+    if(KSTACK(kstack_next) + PGSIZE <= KSTACK_END) {
+        uint64 pa = (uint64)pmem_alloc(true);
+        if(pa != 0) {
+            va = KSTACK(kstack_next++);
+            vm_mappages(kernel_pgtbl, va, pa, PGSIZE, PTE_R | PTE_W);
+            __sync_synchronize();
+            kstack_gen++;
+        }
+    }
+    spinlock_release(&kstack_lk);
+    return va;
 }
 
+// 切换到一个进程的内核栈之前调用(关中断)
+// 硬件可能缓存了无效的PTE, 本hart上次刷新之后有新的内核栈映射时整体刷新一次
+void kvm_kstack_sync()
+{
+    cpu_t* c = mycpu();
+    uint64 gen = kstack_gen;
+
+    if(c->kstack_gen != gen) {
+        sfence_vma();
+        c->kstack_gen = gen;
+    }
+}
+
+// 用户地址 [begin, end) 是否与用户页表中保留给内核的部分冲突
+bool kvm_user_conflict(uint64 begin, uint64 end)
+{
+#if KERNEL_IN_UPGTBL
+    // RAM所在的level-2表项整个共享给用户页表, 覆盖1GB
+    uint64 gb = 1ul << VA_SHIFT(2);
+    if(begin < ((PHYSTOP + gb - 1) & ~(gb - 1)) && end > KERNEL_BASE)
+        return true;
+
+    // MMIO所在的level-1表项复制给了用户页表, 每项覆盖2MB
+    for(int i = 0; i < NMMIO; i++) {
+        uint64 lo = kernel_mmio[i].base & ~(MEGA_PGSIZE - 1);
+        uint64 hi = (kernel_mmio[i].base + kernel_mmio[i].size + MEGA_PGSIZE - 1) & ~(MEGA_PGSIZE - 1);
+        if(begin < hi && end > lo)
+            return true;
+    }
+    return false;
+#else
+    // 内核RAM的全局映射(PTE_G)在所有ASID下都会命中
+    return begin < PHYSTOP && end > KERNEL_BASE;
+#endif
+}
+
+// 用户地址va之后第一个保留给内核的地址(没有则返回VA_MAX)
+// 调用者保证va本身不冲突, [va, 返回值) 与内核部分不重叠
+uint64 kvm_user_limit(uint64 va)
+{
+    uint64 limit = VA_MAX;
+#if KERNEL_IN_UPGTBL
+    if(va < KERNEL_BASE)
+        limit = KERNEL_BASE;
+    for(int i = 0; i < NMMIO; i++) {
+        uint64 lo = kernel_mmio[i].base & ~(MEGA_PGSIZE - 1);
+        if(lo >= va && lo < limit)
+            limit = lo;
+    }
+#else
+    if(va < KERNEL_BASE)
+        limit = KERNEL_BASE;
+#endif
+    return limit;
+}
+
+#if KERNEL_IN_UPGTBL
+
+// 把内核映射共享给用户页表pgtbl
+// RAM所在的level-2表项直接指向内核的level-1页表
+// MMIO所在的level-2表项下还有用户映射, 只复制对应的level-1表项
+// 成功返回0, 申请页表页失败返回-1(已经共享的部分由 uvm_destroy_pgtbl 解除)
+int kvm_share(pgtbl_t pgtbl)
+{
+    for(uint64 va = KERNEL_BASE; va < PHYSTOP; va += 1ul << VA_SHIFT(2))
+        pgtbl[VA_TO_VPN(va, 2)] = kernel_pgtbl[VA_TO_VPN(va, 2)];
+
+    for(int i = 0; i < NMMIO; i++) {
+        uint64 end = kernel_mmio[i].base + kernel_mmio[i].size;
+        for(uint64 va = kernel_mmio[i].base & ~(MEGA_PGSIZE - 1); va < end; va += MEGA_PGSIZE) {
+            pte_t* kpte = getpte_level(kernel_pgtbl, va, false, 1);
+            assert(kpte != NULL, "kvm_share: kernel mmio not mapped");
+            pte_t* upte = getpte_level(pgtbl, va, true, 1);
+            if(upte == NULL)
+                return -1;
+            *upte = *kpte;
+        }
+    }
+    return 0;
+}
+
+// 解除kvm_share建立的共享, 之后销毁用户页表时不会释放内核的页表页
+void kvm_unshare(pgtbl_t pgtbl)
+{
+    for(uint64 va = KERNEL_BASE; va < PHYSTOP; va += 1ul << VA_SHIFT(2))
+        pgtbl[VA_TO_VPN(va, 2)] = 0;
+
+    for(int i = 0; i < NMMIO; i++) {
+        uint64 end = kernel_mmio[i].base + kernel_mmio[i].size;
+        for(uint64 va = kernel_mmio[i].base & ~(MEGA_PGSIZE - 1); va < end; va += MEGA_PGSIZE) {
+            pte_t* upte = getpte_level(pgtbl, va, false, 1);
+            if(upte != NULL)
+                *upte = 0;
+        }
+    }
+}
+
+// 切换回内核页表
+// 内核映射在两边完全相同, 不需要刷新TLB
+void kvm_switch()
+{
+    w_satp(MAKE_SATP(kernel_pgtbl));
+}
+
+#endif
+
 // for debug
 // 输出页表内容
 void vm_print(pgtbl_t pgtbl)
@@ -162,7 +411,10 @@ void vm_print(pgtbl_t pgtbl)
     {
         pte = pgtbl_2[i];
         if(!((pte) & PTE_V)) continue;
-        assert(PTE_CHECK(pte), "vm_print: pte check fail (1)");
+        if(!PTE_CHECK(pte)) {
+            printf(".. gigapage %d: pa = %p flags = %d\n", i, (uint64)PTE_TO_PA(pte), (int)PTE_FLAGS(pte));
+            continue;
+        }
         pgtbl_1 = (pgtbl_t)PTE_TO_PA(pte);
         printf(".. level-1 pgtbl %d: pa = %p\n", i, pgtbl_1);
         
@@ -170,7 +422,10 @@ void vm_print(pgtbl_t pgtbl)
         {
             pte = pgtbl_1[j];
             if(!((pte) & PTE_V)) continue;
-            assert(PTE_CHECK(pte), "vm_print: pte check fail (2)");
+            if(!PTE_CHECK(pte)) {
+                printf(".. .. megapage %d: pa = %p flags = %d\n", j, (uint64)PTE_TO_PA(pte), (int)PTE_FLAGS(pte));
+                continue;
+            }
             pgtbl_0 = (pgtbl_t)PTE_TO_PA(pte);
             printf(".. .. level-0 pgtbl %d: pa = %p\n", j, pgtbl_0);
 
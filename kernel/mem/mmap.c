@@ -4,99 +4,517 @@
 #include "mem/pmem.h"
 #include "mem/vmem.h"
 #include "mem/mmap.h"
+#include "mem/kmem.h"
 #include "common.h"
 #include "memlayout.h"
 #include "riscv.h"
 
-// 包装 mmap_region_t 用于仓库组织
-typedef struct mmap_region_node {
-    mmap_region_t mmap;
-    struct mmap_region_node* next;
-} mmap_region_node_t;
+// mmap_region_t 从专门的slab cache里申请, 没有全局数量上限
+static kmem_cache_t* mmap_cache;
 
-#define N_MMAP 256
-
-// mmap_region_node_t 仓库(单向链表) + 指向链表头节点的指针 + 保护仓库的锁
-static mmap_region_node_t list_mmap_region_node[N_MMAP];
-static mmap_region_node_t* list_head;
-static spinlock_t list_lk;
-
-// 初始化上述三个数据结构
+// 初始化 mmap_region_t 的cache
 void mmap_init()
 {
-    spinlock_init(&list_lk, "mmap_list");
+    mmap_cache = kmem_cache_create("mmap_region", sizeof(mmap_region_t));
     
-    // 将所有节点串成链表
-    list_head = &list_mmap_region_node[0];
-    for(int i = 0; i < N_MMAP - 1; i++) {
-        list_mmap_region_node[i].next = &list_mmap_region_node[i + 1];
-    }
-    list_mmap_region_node[N_MMAP - 1].next = NULL;
-    
-    printf("mmap_init: initialized %d mmap nodes\n", N_MMAP);
+    printf("mmap_init: mmap regions come from slab cache\n");
 }
 
-// 从仓库申请一个 mmap_region_t
-// 若申请失败则 panic
-// 注意: list_head 保留, 不会被申请出去
+// 申请一个 mmap_region_t
+// 返回的节点已经清空, 内存不足时返回NULL
 mmap_region_t* mmap_region_alloc()
 {
     // 检查是否已初始化
-    if(list_head == NULL) {
+    if(mmap_cache == NULL) {
         panic("mmap_region_alloc: mmap not initialized! Call mmap_init() first");
     }
     
-    spinlock_acquire(&list_lk);
-    
-    // list_head 自己不分配出去，从 list_head->next 开始分配
-    if(list_head->next == NULL) {
-        spinlock_release(&list_lk);
-        panic("mmap_region_alloc: out of mmap nodes");
-    }
-    
-    mmap_region_node_t* node = list_head->next;
-    list_head->next = node->next;
-    
-    spinlock_release(&list_lk);
-    
-    // 清空返回的节点
-    node->mmap.begin = 0;
-    node->mmap.npages = 0;
-    node->mmap.next = NULL;
-    node->next = NULL;
-    
-    return &(node->mmap);
+    return kmem_cache_alloc(mmap_cache);
 }
 
-// 向仓库归还一个 mmap_region_t
+// 归还一个 mmap_region_t
 void mmap_region_free(mmap_region_t* mmap)
 {
     if(mmap == NULL) return;
     
-    spinlock_acquire(&list_lk);
-    
-    // 将节点插入链表头部
-    mmap_region_node_t* node = (mmap_region_node_t*)((char*)mmap - __builtin_offsetof(mmap_region_node_t, mmap));
-    node->next = list_head->next;
-    list_head->next = node;
-    
-    spinlock_release(&list_lk);
+    kmem_cache_free(mmap_cache, mmap);
 }
 
-// 输出仓库里可用的 mmap_region_node_t
+// 输出 mmap_region_t 的使用情况
 // for debug
 void mmap_show_mmaplist()
 {
-    spinlock_acquire(&list_lk);
-    
-    mmap_region_node_t* tmp = list_head;
-    int node = 1, index = 0;
-    while (tmp)
-    {
-        index = tmp - list_mmap_region_node;
-        printf("node %d index = %d\n", node++, index);
-        tmp = tmp->next;
+    kmem_stat();
+}
+
+/*------------------------- 区间树 -------------------------*/
+
+// 区域的结束地址(不包含)
+static uint64 region_end(mmap_region_t* r)
+{
+    return r->begin + (uint64)r->npages * PGSIZE;
+}
+
+// 间隙的起点: 前一个区域的结束地址, 不低于 MMAP_BEGIN
+static uint64 gap_begin(mmap_region_t* n)
+{
+    uint64 lo = n->prev ? region_end(n->prev) : MMAP_BEGIN;
+    return lo < MMAP_BEGIN ? MMAP_BEGIN : lo;
+}
+
+// 节点n和前一个区域之间的空闲间隙
+static uint64 node_gap(mmap_region_t* n)
+{
+    uint64 lo = gap_begin(n);
+    uint64 hi = n->begin < MMAP_END ? n->begin : MMAP_END;
+    return hi > lo ? hi - lo : 0;
+}
+
+static int node_height(mmap_region_t* n)
+{
+    return n ? n->height : 0;
+}
+
+// 根据子节点重新计算 height 和 max_gap
+static void node_update(mmap_region_t* n)
+{
+    int hl = node_height(n->left), hr = node_height(n->right);
+    n->height = (hl > hr ? hl : hr) + 1;
+
+    n->max_gap = node_gap(n);
+    if(n->left && n->left->max_gap > n->max_gap)
+        n->max_gap = n->left->max_gap;
+    if(n->right && n->right->max_gap > n->max_gap)
+        n->max_gap = n->right->max_gap;
+}
+
+// 在parent下用new替换old(parent为NULL说明old是根)
+static void replace_child(mmap_region_t** root, mmap_region_t* parent,
+                          mmap_region_t* old, mmap_region_t* new)
+{
+    if(parent == NULL)
+        *root = new;
+    else if(parent->left == old)
+        parent->left = new;
+    else
+        parent->right = new;
+    if(new)
+        new->parent = parent;
+}
+
+static mmap_region_t* rotate_left(mmap_region_t** root, mmap_region_t* x)
+{
+    mmap_region_t* y = x->right;
+
+    x->right = y->left;
+    if(y->left)
+        y->left->parent = x;
+    replace_child(root, x->parent, x, y);
+    y->left = x;
+    x->parent = y;
+
+    node_update(x);
+    node_update(y);
+    return y;
+}
+
+static mmap_region_t* rotate_right(mmap_region_t** root, mmap_region_t* x)
+{
+    mmap_region_t* y = x->left;
+
+    x->left = y->right;
+    if(y->right)
+        y->right->parent = x;
+    replace_child(root, x->parent, x, y);
+    y->right = x;
+    x->parent = y;
+
+    node_update(x);
+    node_update(y);
+    return y;
+}
+
+// 从n开始向上更新到根, 沿途恢复AVL平衡
+// 节点的区间或前驱改变后也用它来更新 max_gap
+static void rebalance(mmap_region_t** root, mmap_region_t* n)
+{
+    while(n) {
+        node_update(n);
+        int bf = node_height(n->left) - node_height(n->right);
+        if(bf > 1) {
+            if(node_height(n->left->left) < node_height(n->left->right))
+                rotate_left(root, n->left);
+            n = rotate_right(root, n);
+        } else if(bf < -1) {
+            if(node_height(n->right->right) < node_height(n->right->left))
+                rotate_right(root, n->right);
+            n = rotate_left(root, n);
+        }
+        n = n->parent;
+    }
+}
+
+// 把节点n插入树中(调用者保证不与已有区域重叠)
+static void tree_insert(mmap_region_t** root, mmap_region_t* n)
+{
+    mmap_region_t* parent = NULL;
+    mmap_region_t* pred = NULL;
+    mmap_region_t** link = root;
+
+    while(*link) {
+        parent = *link;
+        if(n->begin < parent->begin) {
+            link = &parent->left;
+        } else {
+            pred = parent;
+            link = &parent->right;
+        }
+    }
+
+    *link = n;
+    n->parent = parent;
+    n->left = n->right = NULL;
+
+    // 没有前驱说明n是新的最小区域, 一路向左走到的parent就是原来的最小区域
+    n->prev = pred;
+    n->next = pred ? pred->next : parent;
+    if(n->prev)
+        n->prev->next = n;
+    if(n->next)
+        n->next->prev = n;
+
+    rebalance(root, n);
+    if(n->next)
+        rebalance(root, n->next);
+}
+
+// 从树中删除节点n, 返回接替n的后继区域(可能就是n这个节点本身)
+// 有两个孩子时把后继的内容搬到n里, 删除后继所在的节点
+static mmap_region_t* tree_erase(mmap_region_t** root, mmap_region_t* n)
+{
+    mmap_region_t* victim;
+    mmap_region_t* result;
+
+    if(n->left && n->right) {
+        mmap_region_t* succ = n->next;
+        n->begin = succ->begin;
+        n->npages = succ->npages;
+        n->perm = succ->perm;
+        n->flags = succ->flags;
+        n->next = succ->next;
+        if(n->next)
+            n->next->prev = n;
+        victim = succ;
+        result = n;
+    } else {
+        if(n->prev)
+            n->prev->next = n->next;
+        if(n->next)
+            n->next->prev = n->prev;
+        victim = n;
+        result = n->next;
     }
 
-    spinlock_release(&list_lk);
-}
\ No newline at end of file
+    mmap_region_t* child = victim->left ? victim->left : victim->right;
+    mmap_region_t* parent = victim->parent;
+    replace_child(root, parent, victim, child);
+    mmap_region_free(victim);
+
+    rebalance(root, parent);
+    if(result)
+        rebalance(root, result);
+    return result;
+}
+
+// 结束地址大于addr的第一个区域
+static mmap_region_t* tree_end_after(mmap_region_t* root, uint64 addr)
+{
+    mmap_region_t* r = NULL;
+
+    while(root) {
+        if(region_end(root) > addr) {
+            r = root;
+            root = root->left;
+        } else {
+            root = root->right;
+        }
+    }
+    return r;
+}
+
+// 开始地址小于addr的最后一个区域
+static mmap_region_t* tree_begin_before(mmap_region_t* root, uint64 addr)
+{
+    mmap_region_t* r = NULL;
+
+    while(root) {
+        if(root->begin < addr) {
+            r = root;
+            root = root->right;
+        } else {
+            root = root->left;
+        }
+    }
+    return r;
+}
+
+// 地址最低的区域
+mmap_region_t* mmap_first(mmap_region_t* root)
+{
+    if(root == NULL)
+        return NULL;
+    while(root->left)
+        root = root->left;
+    return root;
+}
+
+// 包含va的区域, 没有则返回NULL
+mmap_region_t* mmap_find(mmap_region_t* root, uint64 va)
+{
+    mmap_region_t* r = tree_end_after(root, va);
+    if(r && r->begin <= va)
+        return r;
+    return NULL;
+}
+
+// [begin, end) 是否与已有区域重叠
+bool mmap_overlap(mmap_region_t* root, uint64 begin, uint64 end)
+{
+    mmap_region_t* r = tree_end_after(root, begin);
+    return r != NULL && r->begin < end;
+}
+
+// 在 [MMAP_BEGIN, MMAP_END) 中找到地址最低的、至少len字节的空闲范围
+// 返回起始地址, 找不到返回0
+uint64 mmap_find_gap(mmap_region_t* root, uint64 len)
+{
+    mmap_region_t* n = root;
+
+    while(n && n->max_gap >= len) {
+        if(n->left && n->left->max_gap >= len) {
+            n = n->left;
+        } else if(node_gap(n) >= len) {
+            return gap_begin(n);
+        } else {
+            n = n->right;
+        }
+    }
+
+    // 所有区域之后的空闲范围
+    uint64 lo = MMAP_BEGIN;
+    for(n = root; n && n->right; n = n->right)
+        ;
+    if(n && region_end(n) > lo)
+        lo = region_end(n);
+    if(lo + len <= MMAP_END)
+        return lo;
+    return 0;
+}
+
+// 新增区域 [begin, begin + npages * PGSIZE), 调用者保证不与已有区域重叠
+// 与前后相邻且权限和标志都相同的区域合并
+// 成功返回0, 申请不到节点返回-1(树保持不变)
+int mmap_insert(mmap_region_t** root, uint64 begin, uint32 npages, int perm, int flags)
+{
+    uint64 end = begin + (uint64)npages * PGSIZE;
+    mmap_region_t* prev = tree_begin_before(*root, begin);
+    mmap_region_t* next = prev ? prev->next : mmap_first(*root);
+
+    if(prev && region_end(prev) == begin && prev->perm == perm && prev->flags == flags) {
+        prev->npages += npages;
+        if(next && next->begin == end && next->perm == perm && next->flags == flags) {
+            prev->npages += next->npages;
+            tree_erase(root, next);
+        }
+        rebalance(root, prev);
+        if(prev->next)
+            rebalance(root, prev->next);
+        return 0;
+    }
+
+    if(next && next->begin == end && next->perm == perm && next->flags == flags) {
+        next->begin = begin;
+        next->npages += npages;
+        rebalance(root, next);
+        return 0;
+    }
+
+    mmap_region_t* n = mmap_region_alloc();
+    if(n == NULL)
+        return -1;
+    n->begin = begin;
+    n->npages = npages;
+    n->perm = perm;
+    n->flags = flags;
+    tree_insert(root, n);
+    return 0;
+}
+
+// 删除 [begin, end) 范围内的区域, 部分重叠的区域被截短或拆成两段
+// 成功返回0, 拆分时申请不到节点返回-1(树保持不变)
+int mmap_remove(mmap_region_t** root, uint64 begin, uint64 end)
+{
+    mmap_region_t* r = tree_end_after(*root, begin);
+
+    while(r && r->begin < end) {
+        uint64 rb = r->begin, re = region_end(r);
+
+        if(begin <= rb && end >= re) {
+            // 整个区域都被删除
+            r = tree_erase(root, r);
+        } else if(begin <= rb) {
+            // 删除头部
+            r->begin = end;
+            r->npages = (re - end) / PGSIZE;
+            rebalance(root, r);
+            break;
+        } else if(end >= re) {
+            // 删除尾部
+            r->npages = (begin - rb) / PGSIZE;
+            rebalance(root, r);
+            r = r->next;
+            if(r)
+                rebalance(root, r);
+        } else {
+            // 删除中间, 拆成两段(这种情况只会在第一轮出现, 失败时还没有修改过树)
+            mmap_region_t* n = mmap_region_alloc();
+            if(n == NULL)
+                return -1;
+
+            r->npages = (begin - rb) / PGSIZE;
+            rebalance(root, r);
+
+            n->begin = end;
+            n->npages = (re - end) / PGSIZE;
+            n->perm = r->perm;
+            n->flags = r->flags;
+            tree_insert(root, n);
+            break;
+        }
+    }
+    return 0;
+}
+
+// addr 是否落在某个区域内部(不是区域的边界)
+static bool inside_region(mmap_region_t* root, uint64 addr)
+{
+    mmap_region_t* r = tree_end_after(root, addr);
+    return r != NULL && r->begin < addr;
+}
+
+// 把内部包含addr的区域在addr处切成两段, 后一段使用节点n
+static void split_at(mmap_region_t** root, uint64 addr, mmap_region_t* n)
+{
+    mmap_region_t* r = tree_end_after(*root, addr);
+    uint64 re = region_end(r);
+
+    r->npages = (addr - r->begin) / PGSIZE;
+    rebalance(root, r);
+
+    n->begin = addr;
+    n->npages = (re - addr) / PGSIZE;
+    n->perm = r->perm;
+    n->flags = r->flags;
+    tree_insert(root, n);
+}
+
+// r和后一个区域相邻且权限和标志都相同时合并, 合并了返回true
+static bool merge_next(mmap_region_t** root, mmap_region_t* r)
+{
+    mmap_region_t* next = r->next;
+
+    if(next == NULL || next->begin != region_end(r))
+        return false;
+    if(next->perm != r->perm || next->flags != r->flags)
+        return false;
+
+    r->npages += next->npages;
+    tree_erase(root, next);
+    rebalance(root, r);
+    if(r->next)
+        rebalance(root, r->next);
+    return true;
+}
+
+// 把 [begin, end) 内区域的权限改成perm, 边界落在区域内部时拆分区域
+// 修改后与相邻区域合并
+// 成功返回0, 范围没有被区域完整覆盖 或 申请不到节点返回-1(树保持不变)
+int mmap_protect(mmap_region_t** root, uint64 begin, uint64 end, int perm)
+{
+    mmap_region_t* r;
+    uint64 addr = begin;
+
+    for(r = tree_end_after(*root, begin); r && addr < end; r = r->next) {
+        if(r->begin > addr)
+            return -1;
+        addr = region_end(r);
+    }
+    if(addr < end)
+        return -1;
+
+    // 先申请好拆分需要的节点, 失败时还没有修改过树
+    bool split_begin = inside_region(*root, begin);
+    bool split_end = inside_region(*root, end);
+    mmap_region_t* n1 = NULL;
+    mmap_region_t* n2 = NULL;
+
+    if(split_begin && (n1 = mmap_region_alloc()) == NULL)
+        return -1;
+    if(split_end && (n2 = mmap_region_alloc()) == NULL) {
+        if(n1)
+            mmap_region_free(n1);
+        return -1;
+    }
+
+    if(split_begin)
+        split_at(root, begin, n1);
+    if(split_end)
+        split_at(root, end, n2);
+
+    r = tree_end_after(*root, begin);
+    for(mmap_region_t* t = r; t && t->begin < end; t = t->next)
+        t->perm = perm;
+
+    // 从begin前面的区域开始, 一直合并到从end开始的区域
+    if(r->prev)
+        r = r->prev;
+    while(r && r->begin < end) {
+        if(!merge_next(root, r))
+            r = r->next;
+    }
+    return 0;
+}
+
+// 复制整棵树到 *new_root (fork时使用)
+// 成功返回0, 内存不足返回-1(已经复制的部分会被释放)
+int mmap_dup(mmap_region_t* root, mmap_region_t** new_root)
+{
+    *new_root = NULL;
+
+    for(mmap_region_t* r = mmap_first(root); r != NULL; r = r->next) {
+        mmap_region_t* n = mmap_region_alloc();
+        if(n == NULL) {
+            mmap_destroy(*new_root);
+            *new_root = NULL;
+            return -1;
+        }
+        n->begin = r->begin;
+        n->npages = r->npages;
+        n->perm = r->perm;
+        n->flags = r->flags;
+        tree_insert(new_root, n);
+    }
+    return 0;
+}
+
+// 释放整棵树
+void mmap_destroy(mmap_region_t* root)
+{
+    mmap_region_t* r = mmap_first(root);
+
+    while(r != NULL) {
+        mmap_region_t* next = r->next;
+        mmap_region_free(r);
+        r = next;
+    }
+}
@@ -1,117 +1,698 @@
 #include "mem/pmem.h"
+#include "proc/cpu.h"
 #include "lib/print.h"
 #include "lib/lock.h"
 #include "lib/str.h"
+#include "memlayout.h"
 #include "common.h"
 #include "riscv.h"
 
-// 物理页节点
-typedef struct page_node {
-    struct page_node* next;
-} page_node_t;
+/*
+    伙伴系统(buddy system)
+    
+    空闲内存以 2^order 个页面的块为单位管理, order 取 0 ~ PMEM_MAX_ORDER
+    每个块的起始物理地址按块大小对齐, 因此一个块的伙伴地址是 pa ^ (PGSIZE << order)
+    分配: 找到不小于所需阶的最小空闲块, 逐级对半拆分, 多出的一半挂回低一阶的链
+    释放: 只要伙伴也是同阶空闲块就合并成高一阶的块, 一直向上直到不能合并
+*/
+
+// 空闲块节点(存放在空闲块的首页里)
+typedef struct free_block {
+    struct free_block* next;
+    struct free_block* prev;
+} free_block_t;
 
 // 许多物理页构成一个可分配的区域
 typedef struct alloc_region {
-    uint64 begin;          // 起始物理地址
-    uint64 end;            // 终止物理地址
-    spinlock_t lk;         // 自旋锁(保护下面两个变量)
-    uint32 allocable;      // 可分配页面数    
-    page_node_t list_head; // 可分配链的链头节点
+    uint64 begin;          // 初始的起始物理地址
+    uint64 end;            // 初始的终止物理地址
+    uint8  id;             // 区域编号(PMEM_KERNEL / PMEM_USER)
+    uint32 low;            // 低水位: 空闲页少于它时向另一个区域借一个chunk
+    uint32 high;           // 高水位: 空闲页多于它时把借来的chunk还回去
+    spinlock_t lk;         // 自旋锁(保护下面的变量)
+    uint32 allocable;      // 可分配页面数(包括还没切分的部分)
+    uint64 carve;          // 高水位指针: [carve, end) 还没有切分进伙伴系统, 也从未被访问过
+    free_block_t free_area[PMEM_MAX_ORDER + 1]; // 每一阶空闲块的双向循环链表(链头是哨兵)
+    uint32 nfree[PMEM_MAX_ORDER + 1];           // 每一阶空闲块的数量
+    
+    // 区域间平衡
+    int32  borrowed;       // 当前净借入的chunk数(还没还回去的)
+    uint64 nborrow;        // 借入次数
+    uint64 nreturn;        // 归还次数
 } alloc_region_t;
 
 // 内核和用户可分配的物理页分开
 static alloc_region_t kern_region, user_region;
 
-#define KERN_PAGES 1024 // 内核可分配空间占1024个pages
+#define KERN_PAGES 1024 // 内核可分配空间至少占1024个pages
+
+/*
+    内核区域和用户区域之间以 chunk(2^CHUNK_ORDER 页, 1MB)为单位互相借用物理内存
+    每个chunk属于哪个区域记录在 chunk_owner 里, 伙伴只在同一区域的chunk之间合并
+    初始划分时把边界对齐到chunk, 之后只有整块空闲的chunk才会换主人
+    chunk_owner 在chunk被切分进伙伴系统时才填写
+*/
+#define CHUNK_ORDER 8
+#define CHUNK_PAGES (1 << CHUNK_ORDER)
+
+#define KERN_LOW_PAGES  128   // 内核区域低水位
+#define KERN_HIGH_PAGES 1024  // 内核区域高水位
+#define USER_LOW_PAGES  1024  // 用户区域低水位
+#define USER_HIGH_PAGES 4096  // 用户区域高水位
+
+// 每个物理页帧的元数据, 按页帧号索引, 覆盖 KERNEL_BASE ~ PHYSTOP (包括 ALLOC_BEGIN ~ ALLOC_END)
+#define NFRAMES ((PHYSTOP - KERNEL_BASE) / PGSIZE)
+#define PA_TO_FRAME(pa) (((uint64)(pa) - KERNEL_BASE) >> PGSHIFT)
+static page_t pages[NFRAMES];
+
+// 每个chunk当前所属的区域
+#define NCHUNKS (NFRAMES >> CHUNK_ORDER)
+#define PA_TO_CHUNK(pa) (PA_TO_FRAME(pa) >> CHUNK_ORDER)
+static uint8 chunk_owner[NCHUNKS];
+
+#define CHUNK_ROUND_UP(pa) \
+    (KERNEL_BASE + ((((uint64)(pa) - KERNEL_BASE) + ((uint64)PGSIZE << CHUNK_ORDER) - 1) \
+                    & ~(((uint64)PGSIZE << CHUNK_ORDER) - 1)))
+
+/*
+    每个CPU在区域前面挂一个小的页面缓存(弹匣)
+    常见情况下 pmem_alloc/pmem_free 只操作本CPU的缓存, 不碰区域的锁
+    缓存空了就从区域批量补充 PCP_BATCH 页, 满了就批量归还 PCP_BATCH 页
+    缓存只被本CPU访问, 用 push_off/pop_off 关中断保护即可
+
+    缓存分成两个池: clean 池里的页面已经清零, dirty 池里的页面内容未知
+    释放的页面进入 dirty 池, CPU空闲时(见 proc_scheduler)把 dirty 页清零后移入 clean 池
+    需要清零页的申请优先拿 clean 页, 不需要清零的申请优先拿 dirty 页
+*/
+
+#define PCP_ORDER 4                // 补充时优先整块拿一个 2^PCP_ORDER 页的块
+#define PCP_BATCH (1 << PCP_ORDER) // 一次批量补充/归还的页面数
+#define PCP_HIGH  (PCP_BATCH*2)    // 缓存容量上限
+#define PCP_CLEAN_TARGET PCP_BATCH // 空闲时 clean 池至少攒到这么多页
+#define PCP_ZERO_BATCH 4           // 空闲时每次最多清零的页面数
+
+// 物理页节点
+typedef struct page_node {
+    struct page_node* next;
+} page_node_t;
+
+typedef struct pcp_cache {
+    uint32 nclean;         // clean 池中的页面数
+    uint32 ndirty;         // dirty 池中的页面数
+    page_node_t clean;     // clean 池链头
+    page_node_t dirty;     // dirty 池链头
+    
+    // 统计信息
+    uint64 hit;            // 直接从缓存拿到页面的次数
+    uint64 miss;           // 缓存为空的次数
+    uint64 refill;         // 从区域批量补充的次数
+    uint64 drain;          // 向区域批量归还的次数
+    uint64 zero_sync;      // 在申请路径上同步清零的次数
+    uint64 zero_idle;      // 空闲时后台清零的页面数
+} __attribute__((aligned(64))) pcp_cache_t; // 独占cache line, 避免伪共享
+
+// [cpuid][in_kernel]
+static pcp_cache_t pcp[NCPU][2];
+
+/*--------------------- 伙伴系统核心(持有region->lk) ---------------------*/
+
+static void free_area_push(alloc_region_t* region, uint64 pa, uint32 order)
+{
+    free_block_t* head = &region->free_area[order];
+    free_block_t* blk = (free_block_t*)pa;
+    blk->next = head->next;
+    blk->prev = head;
+    head->next->prev = blk;
+    head->next = blk;
+    region->nfree[order]++;
+    pages[PA_TO_FRAME(pa)].order = order + 1;
+}
+
+static void free_area_remove(alloc_region_t* region, uint64 pa, uint32 order)
+{
+    free_block_t* blk = (free_block_t*)pa;
+    blk->prev->next = blk->next;
+    blk->next->prev = blk->prev;
+    region->nfree[order]--;
+    pages[PA_TO_FRAME(pa)].order = 0;
+}
+
+// 把一个空闲块挂进伙伴系统, 能合并就合并(不修改allocable)
+static void buddy_insert(alloc_region_t* region, uint64 pa, uint32 order)
+{
+    while(order < PMEM_MAX_ORDER) {
+        uint64 buddy = KERNEL_BASE + ((pa - KERNEL_BASE) ^ ((uint64)PGSIZE << order));
+        if(buddy < (uint64)ALLOC_BEGIN || buddy >= (uint64)ALLOC_END)
+            break;
+        if(chunk_owner[PA_TO_CHUNK(buddy)] != region->id)
+            break;
+        if(pages[PA_TO_FRAME(buddy)].order != order + 1)
+            break;
+        free_area_remove(region, buddy, order);
+        if(buddy < pa)
+            pa = buddy;
+        order++;
+    }
+
+    free_area_push(region, pa, order);
+}
+
+// 从未切分部分 [carve, end) 的开头切下一个尽可能大的对齐块挂进伙伴系统
+// 已经没有可切的部分则返回false
+static bool region_carve(alloc_region_t* region)
+{
+    uint64 pa = region->carve;
+    if(pa >= region->end)
+        return false;
+
+    uint32 order = PMEM_MAX_ORDER;
+    while(((pa - KERNEL_BASE) & (((uint64)PGSIZE << order) - 1)) != 0 ||
+          pa + ((uint64)PGSIZE << order) > region->end)
+        order--;
+
+    uint64 size = (uint64)PGSIZE << order;
+    for(uint64 c = PA_TO_CHUNK(pa); c <= PA_TO_CHUNK(pa + size - 1); c++)
+        chunk_owner[c] = region->id;
+
+    region->carve = pa + size;
+    buddy_insert(region, pa, order);
+    return true;
+}
+
+// 申请一个 2^order 页的块, 失败返回0
+static uint64 buddy_alloc(alloc_region_t* region, uint32 order)
+{
+    uint32 k;
+    for(;;) {
+        k = order;
+        while(k <= PMEM_MAX_ORDER && region->nfree[k] == 0)
+            k++;
+        if(k <= PMEM_MAX_ORDER)
+            break;
+        // 伙伴系统里没有够大的块, 从未切分部分再切一块
+        if(!region_carve(region))
+            return 0;
+    }
+
+    uint64 pa = (uint64)region->free_area[k].next;
+    free_area_remove(region, pa, k);
+
+    // 大块对半拆分, 高地址的一半挂回低一阶
+    while(k > order) {
+        k--;
+        free_area_push(region, pa + ((uint64)PGSIZE << k), k);
+    }
+
+    region->allocable -= (1 << order);
+    return pa;
+}
+
+// 释放一个 2^order 页的块, 能合并就合并
+static void buddy_free(alloc_region_t* region, uint64 pa, uint32 order)
+{
+    region->allocable += (1 << order);
+    buddy_insert(region, pa, order);
+}
+
+// 区域初始化: [begin, end) 整体作为未切分部分, 不访问其中任何一个页面
+// 伙伴系统用到时再由 region_carve 按需切分
+static void region_init(alloc_region_t* region, char* name, uint8 id, 
+                        uint64 begin, uint64 end, uint32 low, uint32 high)
+{
+    region->begin = begin;
+    region->end = end;
+    region->id = id;
+    region->low = low;
+    region->high = high;
+    region->borrowed = 0;
+    region->nborrow = 0;
+    region->nreturn = 0;
+    spinlock_init(&region->lk, name);
+
+    for(int i = 0; i <= PMEM_MAX_ORDER; i++) {
+        region->free_area[i].next = &region->free_area[i];
+        region->free_area[i].prev = &region->free_area[i];
+        region->nfree[i] = 0;
+    }
+
+    region->carve = begin;
+    region->allocable = (end - begin) / PGSIZE;
+}
+
+static inline alloc_region_t* region_other(alloc_region_t* region)
+{
+    return region == &kern_region ? &user_region : &kern_region;
+}
+
+// 把一个整块空闲的chunk从 from 转给 to
+// from 借出后仍要保持在低水位之上, 成功返回true
+// 调用时不能持有任何区域的锁
+static bool region_move_chunk(alloc_region_t* from, alloc_region_t* to)
+{
+    uint64 blk = 0;
+
+    spinlock_acquire(&from->lk);
+    if(from->allocable >= from->low + CHUNK_PAGES)
+        blk = buddy_alloc(from, CHUNK_ORDER);
+    spinlock_release(&from->lk);
+
+    if(blk == 0)
+        return false;
+
+    // 此时这个chunk不在任何区域的空闲链里, 可以放心改主人
+    chunk_owner[PA_TO_CHUNK(blk)] = to->id;
+
+    spinlock_acquire(&to->lk);
+    buddy_free(to, blk, CHUNK_ORDER);
+    spinlock_release(&to->lk);
+
+    return true;
+}
+
+// 空闲页低于低水位: 向另一个区域借一个chunk
+static bool region_borrow(alloc_region_t* region)
+{
+    if(!region_move_chunk(region_other(region), region))
+        return false;
+
+    spinlock_acquire(&region->lk);
+    region->borrowed++;
+    region->nborrow++;
+    spinlock_release(&region->lk);
+    return true;
+}
+
+// 空闲页高于高水位且手里有借来的chunk: 还一个回去
+static void region_return(alloc_region_t* region)
+{
+    if(region->borrowed <= 0 || region->allocable <= region->high)
+        return;
+
+    if(!region_move_chunk(region, region_other(region)))
+        return;
+
+    spinlock_acquire(&region->lk);
+    region->borrowed--;
+    region->nreturn++;
+    spinlock_release(&region->lk);
+}
+
+// 页面(或块的首页)交给申请者时设置元数据
+static void page_set_allocated(uint64 pa, bool in_kernel)
+{
+    page_t* pg = &pages[PA_TO_FRAME(pa)];
+    proc_t* p = myproc();
+
+    pg->refcnt = 1;
+    pg->flags = in_kernel ? PG_KERNEL : 0;
+    pg->owner = p ? p->pid : 0;
+}
+
+/*------------------------- 每个CPU的页面缓存 -------------------------*/
+
+static inline void pcp_push(page_node_t* head, uint64 pa)
+{
+    page_node_t* p = (page_node_t*)pa;
+    p->next = head->next;
+    head->next = p;
+}
+
+static inline uint64 pcp_pop(page_node_t* head)
+{
+    page_node_t* p = head->next;
+    head->next = p->next;
+    return (uint64)p;
+}
+
+// 从区域取出至多 PCP_BATCH 个页面放入 dirty 池
+// 返回实际取出的页面数
+static uint32 pcp_refill(pcp_cache_t* pc, alloc_region_t* region)
+{
+    uint32 n = 0;
+
+    spinlock_acquire(&region->lk);
+
+    // 优先整块拿, 一次加锁就能凑够一批
+    uint64 blk = buddy_alloc(region, PCP_ORDER);
+    if(blk != 0) {
+        for(n = 0; n < PCP_BATCH; n++)
+            pcp_push(&pc->dirty, blk + n * PGSIZE);
+    } else {
+        uint64 pa;
+        while(n < PCP_BATCH && (pa = buddy_alloc(region, 0)) != 0) {
+            pcp_push(&pc->dirty, pa);
+            n++;
+        }
+    }
+
+    uint32 remain = region->allocable;
+    spinlock_release(&region->lk);
+
+    if(n > 0) {
+        pc->ndirty += n;
+        pc->refill++;
+    }
+
+    // 低于低水位就向另一个区域借, 这次一页都没拿到就借完再试一次
+    if(remain < region->low && region_borrow(region) && n == 0)
+        return pcp_refill(pc, region);
+
+    return n;
+}
+
+// 向区域归还 PCP_BATCH 个页面, 先还 dirty 页, 尽量保住已经清零的页
+static void pcp_drain(pcp_cache_t* pc, alloc_region_t* region)
+{
+    spinlock_acquire(&region->lk);
+    for(int i = 0; i < PCP_BATCH; i++) {
+        if(pc->ndirty > 0) {
+            buddy_free(region, pcp_pop(&pc->dirty), 0);
+            pc->ndirty--;
+        } else {
+            uint64 pa = pcp_pop(&pc->clean);
+            pages[PA_TO_FRAME(pa)].flags &= ~PG_ZEROED;
+            buddy_free(region, pa, 0);
+            pc->nclean--;
+        }
+    }
+    spinlock_release(&region->lk);
+
+    pc->drain++;
+    region_return(region);
+}
+
+// 从本CPU的缓存拿一个页面, 失败返回0
+// 若 zero == true 则保证页面已清零
+static uint64 pcp_alloc(alloc_region_t* region, bool in_kernel, bool zero)
+{
+    uint64 page = 0;
+    bool clean = false;
+
+    push_off();
+    pcp_cache_t* pc = &pcp[mycpuid()][in_kernel];
+
+    if(pc->nclean + pc->ndirty > 0) {
+        pc->hit++;
+    } else {
+        pc->miss++;
+        pcp_refill(pc, region);
+    }
+
+    // 要清零页就优先拿 clean 页, 否则优先拿 dirty 页
+    bool want_clean = zero ? (pc->nclean > 0) : (pc->ndirty == 0);
+    if(want_clean && pc->nclean > 0) {
+        page = pcp_pop(&pc->clean);
+        pc->nclean--;
+        clean = true;
+    } else if(pc->ndirty > 0) {
+        page = pcp_pop(&pc->dirty);
+        pc->ndirty--;
+    }
+
+    if(page != 0 && zero && !clean)
+        pc->zero_sync++;
+
+    pop_off();
+
+    if(page == 0)
+        return 0;
+
+    // 没拿到 clean 页只能在这里同步清零
+    if(zero && !clean)
+        memset((void*)page, 0, PGSIZE);
+
+    page_set_allocated(page, in_kernel);
+    return page;
+}
+
+// 页面放回本CPU缓存的 dirty 池
+static void pcp_free(alloc_region_t* region, bool in_kernel, uint64 page)
+{
+    push_off();
+    pcp_cache_t* pc = &pcp[mycpuid()][in_kernel];
+
+    pcp_push(&pc->dirty, page);
+    pc->ndirty++;
+
+    // 缓存满了就批量还给区域
+    if(pc->nclean + pc->ndirty >= PCP_HIGH) {
+        pcp_drain(pc, region);
+    }
+
+    pop_off();
+}
+
+// 把本CPU缓存里的一部分 dirty 页清零后移入 clean 池
+// 返回这次清零的页面数
+static uint32 pcp_zero_idle(alloc_region_t* region, bool in_kernel)
+{
+    uint32 n = 0;
+
+    while(n < PCP_ZERO_BATCH) {
+        push_off();
+        pcp_cache_t* pc = &pcp[mycpuid()][in_kernel];
+        if(pc->ndirty == 0 && pc->nclean < PCP_CLEAN_TARGET)
+            pcp_refill(pc, region);
+        if(pc->ndirty == 0) {
+            pop_off();
+            break;
+        }
+        uint64 page = pcp_pop(&pc->dirty);
+        pc->ndirty--;
+        pop_off();
+
+        // 清零期间页面不在任何池里, 可以开着中断慢慢做
+        memset((void*)page, 0, PGSIZE);
+
+        pages[PA_TO_FRAME(page)].flags |= PG_ZEROED;
+
+        push_off();
+        pc = &pcp[mycpuid()][in_kernel];
+        pcp_push(&pc->clean, page);
+        pc->nclean++;
+        pc->zero_idle++;
+        pop_off();
+
+        n++;
+    }
+    return n;
+}
+
+/*------------------------------ 对外接口 ------------------------------*/
 
 // 物理内存初始化
+// 只初始化区域的描述信息, 耗时与物理内存大小无关
 void pmem_init(void)
 {
-    // 初始化内核区域
-    kern_region.begin = (uint64)ALLOC_BEGIN;
-    kern_region.end = (uint64)ALLOC_BEGIN + KERN_PAGES * PGSIZE;
-    spinlock_init(&kern_region.lk, "kern_region");
-    kern_region.allocable = KERN_PAGES;
-    kern_region.list_head.next = NULL;
-    
-    // 初始化用户区域
-    user_region.begin = kern_region.end;
-    user_region.end = (uint64)ALLOC_END;
-    spinlock_init(&user_region.lk, "user_region");
-    user_region.allocable = (user_region.end - user_region.begin) / PGSIZE;
-    user_region.list_head.next = NULL;
-    
-    // 将内核区域的所有物理页加入链表
-    page_node_t* p = &kern_region.list_head;
-    for(uint64 pa = kern_region.begin; pa < kern_region.end; pa += PGSIZE) {
-        p->next = (page_node_t*)pa;
-        p = p->next;
-    }
-    p->next = NULL;
-    
-    // 将用户区域的所有物理页加入链表
-    p = &user_region.list_head;
-    for(uint64 pa = user_region.begin; pa < user_region.end; pa += PGSIZE) {
-        p->next = (page_node_t*)pa;
-        p = p->next;
+    // 两个区域的初始边界对齐到chunk, 方便以后整块借还
+    uint64 boundary = CHUNK_ROUND_UP((uint64)ALLOC_BEGIN + KERN_PAGES * PGSIZE);
+
+    region_init(&kern_region, "kern_region", PMEM_KERNEL, 
+                (uint64)ALLOC_BEGIN, boundary, KERN_LOW_PAGES, KERN_HIGH_PAGES);
+    region_init(&user_region, "user_region", PMEM_USER,
+                boundary, (uint64)ALLOC_END, USER_LOW_PAGES, USER_HIGH_PAGES);
+
+    // 每个CPU的缓存一开始都是空的
+    for(int i = 0; i < NCPU; i++) {
+        for(int j = 0; j < 2; j++) {
+            memset(&pcp[i][j], 0, sizeof(pcp_cache_t));
+        }
     }
-    p->next = NULL;
-    
+
     printf("pmem_init: kernel region [%p, %p) pages=%d\n", 
            kern_region.begin, kern_region.end, kern_region.allocable);
     printf("pmem_init: user region [%p, %p) pages=%d\n", 
            user_region.begin, user_region.end, user_region.allocable);
 }
 
+// 申请 2^order 个物理连续的页面, zero = true 时清零
+// 失败返回NULL
+static void* alloc_pages(uint32 order, bool in_kernel, bool zero)
+{
+    alloc_region_t* region = in_kernel ? &kern_region : &user_region;
+    uint64 page = 0;
+
+    if(order > PMEM_MAX_ORDER)
+        return NULL;
+
+    // 单页走本CPU的缓存
+    if(order == 0)
+        return (void*)pcp_alloc(region, in_kernel, zero);
+
+    spinlock_acquire(&region->lk);
+    page = buddy_alloc(region, order);
+    uint32 remain = region->allocable;
+    spinlock_release(&region->lk);
+
+    if(remain < region->low || page == 0) {
+        if(region_borrow(region) && page == 0) {
+            spinlock_acquire(&region->lk);
+            page = buddy_alloc(region, order);
+            spinlock_release(&region->lk);
+        }
+    }
+
+    if(page == 0)
+        return NULL;
+
+    // 清空页面内容
+    if(zero)
+        memset((void*)page, 0, PGSIZE << order);
+
+    page_set_allocated(page, in_kernel);
+    return (void*)page;
+}
+
+// 返回 2^order 个物理连续且清零的页面
+// 失败返回NULL
+void* pmem_alloc_pages(uint32 order, bool in_kernel)
+{
+    return alloc_pages(order, in_kernel, true);
+}
+
+// 返回 2^order 个物理连续的页面, 不保证内容为0(马上会整页覆盖时使用)
+// 失败返回NULL
+void* pmem_alloc_pages_nozero(uint32 order, bool in_kernel)
+{
+    return alloc_pages(order, in_kernel, false);
+}
+
+// 释放 pmem_alloc_pages 得到的 2^order 个页面
+// 引用计数减到0时才真正释放
+// 失败则panic锁死
+void pmem_free_pages(uint64 page, uint32 order, bool in_kernel)
+{
+    alloc_region_t* region = in_kernel ? &kern_region : &user_region;
+
+    // 检查阶数和地址对齐
+    if(order > PMEM_MAX_ORDER) {
+        panic("pmem_free_pages: bad order");
+    }
+    if((page - KERNEL_BASE) % ((uint64)PGSIZE << order) != 0) {
+        panic("pmem_free_pages: page not aligned");
+    }
+
+    // 检查地址范围和所属区域
+    if(page < (uint64)ALLOC_BEGIN || page + ((uint64)PGSIZE << order) > (uint64)ALLOC_END) {
+        panic("pmem_free_pages: page out of range");
+    }
+    if(chunk_owner[PA_TO_CHUNK(page)] != region->id) {
+        panic("pmem_free_pages: page not in this region");
+    }
+
+    // 还有别人在用就只减引用计数
+    page_t* pg = &pages[PA_TO_FRAME(page)];
+    if(pg->refcnt == 0) {
+        panic("pmem_free_pages: page already free");
+    }
+    if(__sync_sub_and_fetch(&pg->refcnt, 1) > 0) {
+        return;
+    }
+    if(pg->flags & PG_PINNED) {
+        panic("pmem_free_pages: page pinned");
+    }
+    pg->flags = 0;
+    pg->owner = 0;
+
+    if(order == 0) {
+        pcp_free(region, in_kernel, page);
+    } else {
+        spinlock_acquire(&region->lk);
+        buddy_free(region, page, order);
+        spinlock_release(&region->lk);
+        region_return(region);
+    }
+}
+
 // 返回一个可分配的干净物理页
 // 失败则panic锁死
 void* pmem_alloc(bool in_kernel)
 {
-    alloc_region_t* region = in_kernel ? &kern_region : &user_region;
-    
-    spinlock_acquire(&region->lk);
-    
-    // 从链表头取出一个页面
-    page_node_t* page = region->list_head.next;
+    void* page = pmem_alloc_pages(0, in_kernel);
     if(page == NULL) {
-        spinlock_release(&region->lk);
         panic("pmem_alloc: out of memory");
     }
-    
-    region->list_head.next = page->next;
-    region->allocable--;
-    
-    spinlock_release(&region->lk);
-    
-    // 清空页面内容
-    memset((void*)page, 0, PGSIZE);
-    
-    return (void*)page;
+    return page;
+}
+
+// 返回一个可分配的物理页, 不保证内容为0
+// 适用于马上会整页覆盖的场景(比如fork时拷贝页面)
+// 失败则panic锁死
+void* pmem_alloc_nozero(bool in_kernel)
+{
+    void* page = pmem_alloc_pages_nozero(0, in_kernel);
+    if(page == NULL) {
+        panic("pmem_alloc_nozero: out of memory");
+    }
+    return page;
 }
 
 // 释放物理页
 // 失败则panic锁死
 void pmem_free(uint64 page, bool in_kernel)
 {
-    // 检查地址对齐
-    if(page % PGSIZE != 0) {
-        panic("pmem_free: page not aligned");
+    pmem_free_pages(page, 0, in_kernel);
+}
+
+// 返回物理地址 pa 所在页帧的元数据
+page_t* pmem_page(uint64 pa)
+{
+    if(pa < (uint64)ALLOC_BEGIN || pa >= (uint64)ALLOC_END) {
+        panic("pmem_page: pa out of range");
     }
-    
-    alloc_region_t* region = in_kernel ? &kern_region : &user_region;
-    
-    // 检查地址范围
-    if(page < region->begin || page >= region->end) {
-        panic("pmem_free: page out of range");
+    return &pages[PA_TO_FRAME(pa)];
+}
+
+// 多一个使用者共享这个页面: 引用计数加一
+void pmem_get(uint64 page)
+{
+    page_t* pg = pmem_page(page);
+    if(pg->refcnt == 0) {
+        panic("pmem_get: page is free");
     }
-    
-    spinlock_acquire(&region->lk);
-    
-    // 将页面插入链表头
-    page_node_t* p = (page_node_t*)page;
-    p->next = region->list_head.next;
-    region->list_head.next = p;
-    region->allocable++;
-    
-    spinlock_release(&region->lk);
-}
\ No newline at end of file
+    __sync_fetch_and_add(&pg->refcnt, 1);
+}
+
+// 返回页面的引用计数
+uint32 pmem_refcnt(uint64 page)
+{
+    return pmem_page(page)->refcnt;
+}
+
+// CPU空闲时调用: 后台清零本CPU缓存中的 dirty 页
+// 返回这次清零的页面数(0说明暂时没有活可干)
+uint32 pmem_idle(void)
+{
+    uint32 n = pcp_zero_idle(&kern_region, PMEM_KERNEL);
+    n += pcp_zero_idle(&user_region, PMEM_USER);
+    return n;
+}
+
+// 输出各区域的空闲页面数和每个CPU缓存的命中情况(在控制台按 Ctrl-P)
+// 不加锁, 和 proc_dump 一样只作参考, 避免在中断里等待被打断的代码持有的锁
+void pmem_stat(void)
+{
+    alloc_region_t* regions[2] = {&kern_region, &user_region};
+
+    for(int r = 0; r < 2; r++) {
+        alloc_region_t* region = regions[r];
+        printf("pmem_stat: %s free=%d, blocks per order:", region->lk.name, region->allocable);
+        for(int i = 0; i <= PMEM_MAX_ORDER; i++)
+            printf(" %d", region->nfree[i]);
+        printf("\n");
+        printf("  uncarved=%d pages, borrowed=%d chunks, borrow=%d return=%d (low=%d high=%d)\n",
+               (int)((region->end - region->carve) / PGSIZE),
+               region->borrowed, (int)region->nborrow, (int)region->nreturn,
+               region->low, region->high);
+    }
+
+    for(int i = 0; i < NCPU; i++) {
+        for(int j = 1; j >= 0; j--) {
+            pcp_cache_t* pc = &pcp[i][j];
+            printf("  cpu %d %s: clean=%d dirty=%d hit=%d miss=%d refill=%d drain=%d zero_sync=%d zero_idle=%d\n",
+                   i, j ? "kern" : "user", pc->nclean, pc->ndirty,
+                   (int)pc->hit, (int)pc->miss, (int)pc->refill, (int)pc->drain,
+                   (int)pc->zero_sync, (int)pc->zero_idle);
+        }
+    }
+}
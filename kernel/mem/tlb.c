@@ -0,0 +1,188 @@
+// cross-hart TLB shootdown
+
+#include "mem/vmem.h"
+#include "proc/cpu.h"
+#include "lib/print.h"
+#include "lib/lock.h"
+#include "dev/timer.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "common.h"
+
+/*
+    修改或删除进程p的页表映射之后, 调用 tlb_shootdown 让所有可能缓存了旧映射的hart刷新TLB
+
+    本hart直接刷新
+    其他hart分两种情况(只考虑 p->cpus_ran 里登记过的hart):
+    1. 正在运行p: 把刷新请求放进这个hart的信箱, 发核间中断, 等它处理完再返回
+       (返回之后调用者才能释放物理页)
+    2. 没有运行p(lazy): 只在 p->tlb_pending 里记一笔, p下次在这个hart上运行时由 asid_switch 刷新
+
+    核间中断: 写 CLINT_MSIP 触发目标hart的M-mode软件中断, timer_vector 转发成S-mode软件中断
+    信箱里可以攒多个请求(来自不同的发送者), 一次中断全部处理, 请求太多时退化成整体刷新
+
+    发送者关中断等待, 调用者还可能持有自旋锁, 两个hart可能同时在等对方
+    所以等待循环里一直轮询并处理自己的信箱, 不依赖中断
+*/
+
+#define TLB_BATCH 8
+
+typedef struct tlb_mailbox {
+    spinlock_t lk;
+    int nreq;                // 请求数量
+    bool flush_all;          // 请求太多, 整体刷新
+    struct {
+        proc_t* p;
+        uint64 begin;
+        uint64 end;
+    } req[TLB_BATCH];
+    volatile uint64 seq;     // 已经发出的请求序号
+    volatile uint64 done;    // 已经处理完的请求序号
+} tlb_mailbox_t;
+
+static tlb_mailbox_t mailbox[NCPU];
+
+void tlb_init()
+{
+    for(int i = 0; i < NCPU; i++) {
+        spinlock_init(&mailbox[i].lk, "tlb");
+        mailbox[i].nreq = 0;
+        mailbox[i].flush_all = false;
+        mailbox[i].seq = 0;
+        mailbox[i].done = 0;
+    }
+}
+
+// 向hart发送核间中断
+static void ipi_send(int hart)
+{
+    *(volatile uint32*)CLINT_MSIP(hart) = 1;
+}
+
+// 把请求放进hart的信箱, 返回请求序号
+// p == NULL 表示整体刷新
+static uint64 mailbox_post(int hart, proc_t* p, uint64 begin, uint64 end)
+{
+    tlb_mailbox_t* mb = &mailbox[hart];
+    uint64 seq;
+
+    spinlock_acquire(&mb->lk);
+    if(p != NULL && mb->nreq < TLB_BATCH) {
+        mb->req[mb->nreq].p = p;
+        mb->req[mb->nreq].begin = begin;
+        mb->req[mb->nreq].end = end;
+        mb->nreq++;
+    } else {
+        mb->flush_all = true;
+    }
+    seq = ++mb->seq;
+    spinlock_release(&mb->lk);
+
+    return seq;
+}
+
+// 等待各个hart处理完序号为seq[hart]的请求(0表示没有请求, 关中断状态下调用)
+// 等待期间轮询并处理发给自己的请求: 对方可能也关着中断在等自己
+static void mailbox_wait(uint64 seq[NCPU])
+{
+    for(int hart = 0; hart < NCPU; hart++) {
+        while(seq[hart] != 0 && mailbox[hart].done < seq[hart])
+            tlb_ipi_handler();
+    }
+}
+
+// 刷新p的页表中 [begin, end) 在所有hart上的TLB项
+void tlb_shootdown(proc_t* p, uint64 begin, uint64 end)
+{
+    uint64 seq[NCPU];
+    int me, hart;
+
+    push_off();
+    me = mycpuid();
+    asid_flush_range(p, begin, end);
+
+    // 先登记pending再检查目标hart在运行什么, 和 asid_switch 的顺序相反
+    uint64 others = p->cpus_ran & ~(1ul << me);
+    __sync_fetch_and_or(&p->tlb_pending, others);
+
+    for(hart = 0; hart < NCPU; hart++) {
+        seq[hart] = 0;
+        if(!(others & (1ul << hart)))
+            continue;
+        if(getcpu(hart)->proc != p)
+            continue;
+        seq[hart] = mailbox_post(hart, p, begin, end);
+        ipi_send(hart);
+    }
+
+    mailbox_wait(seq);
+    pop_off();
+}
+
+// 处理本hart信箱里的请求(关中断状态下调用)
+void tlb_ipi_handler()
+{
+    tlb_mailbox_t* mb = &mailbox[mycpuid()];
+
+    if(mb->done == mb->seq)
+        return;
+
+    spinlock_acquire(&mb->lk);
+    uint64 seq = mb->seq;
+    if(mb->flush_all || !asid_enabled()) {
+        sfence_vma();
+    } else {
+        for(int i = 0; i < mb->nreq; i++)
+            asid_flush_range(mb->req[i].p, mb->req[i].begin, mb->req[i].end);
+    }
+    mb->nreq = 0;
+    mb->flush_all = false;
+    __sync_synchronize();
+    mb->done = seq;
+    spinlock_release(&mb->lk);
+}
+
+#if KERNEL_TEST
+
+#define TLB_TEST_ROUNDS 1000
+
+static volatile uint64 test_online;  // 进入测试的hart(位图)
+
+// 多hart测试(make KERNEL_TEST=1), 每个hart在进入调度器之前调用
+// 先等1秒让其他hart进入测试, 然后所有hart关着中断同时互相发送整体刷新请求
+// 每个请求都经过核间中断, 双方互相等待时只能靠等待循环处理自己的信箱, 否则会死锁
+void tlb_test()
+{
+    int me = mycpuid();
+    uint64 deadline = timer_mtime() + TIMER_FREQ;
+    uint64 seq[NCPU];
+    int npeers = 0;
+
+    __sync_fetch_and_or(&test_online, 1ul << me);
+    while(timer_mtime() < deadline)
+        ;
+    uint64 peers = test_online & ~(1ul << me);
+
+    push_off();
+    for(int round = 0; round < TLB_TEST_ROUNDS; round++) {
+        for(int hart = 0; hart < NCPU; hart++) {
+            seq[hart] = 0;
+            if(!(peers & (1ul << hart)))
+                continue;
+            seq[hart] = mailbox_post(hart, NULL, 0, 0);
+            ipi_send(hart);
+        }
+        mailbox_wait(seq);
+    }
+    pop_off();
+
+    for(int hart = 0; hart < NCPU; hart++)
+        if(peers & (1ul << hart))
+            npeers++;
+    printf("tlb_test: hart %d sent %d shootdowns to %d harts, all acknowledged\n",
+           me, TLB_TEST_ROUNDS * npeers, npeers);
+    if(npeers == 0)
+        printf("tlb_test: hart %d found no other hart, run with CPUNUM >= 2\n", me);
+}
+
+#endif
@@ -9,30 +9,150 @@
 #include "riscv.h"
 
 // 连续虚拟空间的复制(在uvm_copy_pgtbl中使用)
-static void copy_range(pgtbl_t old, pgtbl_t new, uint64 begin, uint64 end)
+// 写时复制: 父子进程共享物理页(引用计数+1), 可写页面在双方页表里都改成只读+COW
+// 第一次写入时由 uvm_cow_fault 复制
+// shared = true 时(MAP_SHARED区域)保持原有权限, 父子进程一直共享同一组物理页
+// 和 unmap_level 一样逐级递归, 无效的表项直接跳过它覆盖的整个范围,
+// 耗时只和实际映射的页面数有关, 与保留的地址范围大小无关
+// 成功返回0, 子进程的页表页申请失败返回-1
+static int copy_range(pgtbl_t tbl, int level, pgtbl_t new, uint64 va, uint64 end, bool shared)
 {
-    uint64 va, pa, page;
-    int flags;
-    pte_t* pte;
+    uint64 size = 1ul << VA_SHIFT(level);
+    uint64 next;
 
-    for(va = begin; va < end; va += PGSIZE)
-    {
-        pte = vm_getpte(old, va, false);
-        
-        if(pte == NULL || !((*pte) & PTE_V)) {
-            continue;  // 跳过未映射的页
-        }
-        
-        pa = (uint64)PTE_TO_PA(*pte);
-        flags = (int)PTE_FLAGS(*pte);
+    for(uint64 idx = VA_TO_VPN(va, level); idx < PGSIZE / sizeof(pte_t) && va < end; idx++, va = next) {
+        pte_t* pte = &tbl[idx];
+        next = (va & ~(size - 1)) + size;
 
-        page = (uint64)pmem_alloc(false);
-        if(page == 0) {
-            panic("copy_range: pmem_alloc failed");
+        if(!((*pte) & (PTE_V | PTE_PROTNONE)))
+            continue;  // 跳过未映射的范围
+
+        if(level > 0) {
+            // 高层的叶子是内核大页映射, 不属于进程
+            if(!PTE_CHECK(*pte))
+                continue;
+            if(copy_range((pgtbl_t)PTE_TO_PA(*pte), level - 1, new, va,
+                          next < end ? next : end, shared) < 0)
+                return -1;
+            continue;
         }
+
+        pte_t* npte = vm_getpte(new, va, true);
+        if(npte == NULL)
+            return -1;
+
+        // PROT_NONE的页面原样共享, 恢复权限时由 protect_range 决定是否写时复制
+        if(!((*pte) & PTE_PROTNONE) && !shared && ((*pte) & PTE_W))
+            *pte = ((*pte) & ~PTE_W) | PTE_COW;
+
+        pmem_get(PTE_TO_PA(*pte));
+        *npte = *pte;
+    }
+    return 0;
+}
+
+// 处理写时复制引发的 store page fault
+// va所在页面是COW页面则让当前页表独占一份可写的副本
+// 成功返回0, 不是COW页面或内存不足返回-1
+int uvm_cow_fault(pgtbl_t pgtbl, uint64 va)
+{
+    if(va >= VA_MAX)
+        return -1;
+
+    pte_t* pte = vm_getpte(pgtbl, va, false);
+    if(pte == NULL || !((*pte) & PTE_V) || !((*pte) & PTE_U) || !((*pte) & PTE_COW))
+        return -1;
+
+    uint64 pa = PTE_TO_PA(*pte);
+    int flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+
+    if(pmem_refcnt(pa) == 1) {
+        // 其他共享者都已经复制或退出了, 直接恢复写权限
+        *pte = PA_TO_PTE(pa) | flags;
+    } else {
+        // 马上整页覆盖, 不需要清零; 内存不足时由调用者让进程退出或返回错误
+        uint64 page = (uint64)pmem_alloc_pages_nozero(0, PMEM_USER);
+        if(page == 0)
+            return -1;
         memmove((char*)page, (const char*)pa, PGSIZE);
-        vm_mappages(new, va, page, PGSIZE, flags);
+        *pte = PA_TO_PTE(page) | flags;
+        pmem_free(pa, PMEM_USER);
     }
+
+    tlb_shootdown(myproc(), PG_ROUND_DOWN(va), PG_ROUND_DOWN(va) + PGSIZE);
+    return 0;
+}
+
+// [begin, end) 能否作为用户地址使用
+// 不能越过trapframe, 也不能和保留给内核的地址重叠(见kvm_user_conflict)
+bool uvm_range_ok(uint64 begin, uint64 end)
+{
+    if(begin >= end || end > TRAPFRAME)
+        return false;
+    if(kvm_user_conflict(begin, end))
+        return false;
+    return true;
+}
+
+// 缺页处理: va 落在进程已经保留但还没有映射的范围里则分配一个清零的页面
+// 合法范围包括 堆 mmap区域 和 用户栈(栈按需向下增长)
+// write = true 时也负责处理写时复制
+// 成功返回0, 非法访问或内存不足返回-1(调用者让进程退出)
+int uvm_fault(uint64 va, bool write)
+{
+    proc_t* p = myproc();
+    uint64 page_va = PG_ROUND_DOWN(va);
+    int perm = 0;
+    uint64 npages = 0;
+
+    if(va >= VA_MAX)
+        return -1;
+
+    pte_t* pte = vm_getpte(p->pgtbl, page_va, false);
+    // PROT_NONE的页面保留着原来的内容, 不能重新分配
+    if(pte != NULL && ((*pte) & PTE_PROTNONE))
+        return -1;
+    if(pte != NULL && ((*pte) & PTE_V)) {
+        // 已经映射的页面只可能是写时复制
+        if(write)
+            return uvm_cow_fault(p->pgtbl, va);
+        return -1;
+    }
+
+    if(page_va >= PGSIZE && page_va < PG_ROUND_UP(p->heap_top)) {
+        // 堆
+        perm = PTE_R | PTE_W | PTE_U;
+    } else if(page_va >= TRAPFRAME - USTACK_MAX_PAGES * PGSIZE && page_va < TRAPFRAME) {
+        // 用户栈(最多 USTACK_MAX_PAGES 页, 下面是mmap区域上方的guard page)
+        npages = (TRAPFRAME - page_va) / PGSIZE;
+        perm = PTE_R | PTE_W | PTE_U;
+    } else {
+        // mmap区域
+        mmap_region_t* region = mmap_find(p->mmap, page_va);
+        if(region != NULL)
+            perm = region->perm;
+    }
+
+    // PROT_NONE 区域(没有R也没有X)不允许访问
+    if(!(perm & (PTE_R | PTE_X)))
+        return -1;
+    if(write && !(perm & PTE_W))
+        return -1;
+
+    // 用户可以保留远超物理内存的空间, 内存不足是正常情况, 不能panic
+    uint64 pa = (uint64)pmem_alloc_pages(0, PMEM_USER);
+    if(pa == 0)
+        return -1;
+    pte = vm_getpte(p->pgtbl, page_va, true);
+    if(pte == NULL) {
+        pmem_free(pa, PMEM_USER);
+        return -1;
+    }
+    *pte = PA_TO_PTE(pa) | perm | PTE_V;
+
+    if(npages > p->ustack_pages)
+        p->ustack_pages = npages;
+    return 0;
 }
 
 // 递归释放 页表占用的物理页 和 页表管理的物理页
@@ -44,14 +164,17 @@ static void destroy_pgtbl(pgtbl_t pgtbl, uint32 level)
     // 遍历当前级别的所有PTE
     for(int i = 0; i < PGSIZE / sizeof(pte_t); i++) {
         pte_t pte = pgtbl[i];
-        if(pte & PTE_V) {
-            if(level > 1) {
+        if(pte & (PTE_V | PTE_PROTNONE)) {
+            if(level > 1 && !PTE_CHECK(pte)) {
+                // 高层的叶子是内核大页映射, 物理页不属于进程
+                continue;
+            } else if(level > 1) {
                 // 这是一个指向下一级页表的PTE
                 pgtbl_t next_pgtbl = (pgtbl_t)PTE_TO_PA(pte);
                 destroy_pgtbl(next_pgtbl, level - 1);
                 pmem_free((uint64)next_pgtbl, PMEM_KERNEL);
             } else {
-                // level == 1，这是最后一级页表，释放物理页
+                // level == 1，这是最后一级页表，释放物理页(包括PROT_NONE的页面)
                 uint64 pa = PTE_TO_PA(pte);
                 pmem_free(pa, PMEM_USER);
             }
@@ -66,6 +189,11 @@ void uvm_destroy_pgtbl(pgtbl_t pgtbl)
     vm_unmappages(pgtbl, TRAPFRAME, PGSIZE, false);
     vm_unmappages(pgtbl, TRAMPOLINE, PGSIZE, false);
     
+#if KERNEL_IN_UPGTBL
+    // 内核的页表页不属于这个进程
+    kvm_unshare(pgtbl);
+#endif
+
     // 递归销毁页表
     destroy_pgtbl(pgtbl, 3);
     
@@ -74,172 +202,266 @@ void uvm_destroy_pgtbl(pgtbl_t pgtbl)
 }
 
 // 拷贝页表 (拷贝并不包括trapframe 和 trampoline)
-void uvm_copy_pgtbl(pgtbl_t old, pgtbl_t new, uint64 heap_top, uint32 ustack_pages, mmap_region_t* mmap)
+// 物理页面以写时复制的方式共享, 父进程的可写页面也会变成只读
+// 成功返回0, 内存不足返回-1(已经复制的部分由调用者销毁子进程页表时释放)
+int uvm_copy_pgtbl(pgtbl_t old, pgtbl_t new, uint64 heap_top, uint32 ustack_pages, mmap_region_t* mmap)
 {
+    int ret = 0;
+
     /* step-1: 从 PGSIZE 到 heap_top (代码段 + 堆) */
     if(heap_top > PGSIZE) {
-        copy_range(old, new, PGSIZE, PG_ROUND_UP(heap_top));
+        ret = copy_range(old, 2, new, PGSIZE, PG_ROUND_UP(heap_top), false);
     }
 
     /* step-2: 用户栈 */
-    if(ustack_pages > 0) {
+    if(ret == 0 && ustack_pages > 0) {
         uint64 stack_top = TRAPFRAME;
         uint64 stack_bottom = stack_top - ustack_pages * PGSIZE;
-        copy_range(old, new, stack_bottom, stack_top);
+        ret = copy_range(old, 2, new, stack_bottom, stack_top, false);
     }
 
-    /* step-3: mmap_region */
-    mmap_region_t* tmp = mmap;
-    while(tmp != NULL) {
+    /* step-3: mmap_region (按地址顺序遍历) */
+    for(mmap_region_t* tmp = mmap_first(mmap); ret == 0 && tmp != NULL; tmp = tmp->next) {
         uint64 mmap_begin = tmp->begin;
-        uint64 mmap_end = tmp->begin + tmp->npages * PGSIZE;
-        copy_range(old, new, mmap_begin, mmap_end);
-        tmp = tmp->next;
+        uint64 mmap_end = tmp->begin + (uint64)tmp->npages * PGSIZE;
+        ret = copy_range(old, 2, new, mmap_begin, mmap_end, (tmp->flags & MAP_SHARED) != 0);
     }
+
+    /* 父进程的可写页面变成了只读, 刷新它的TLB(失败时也已经改过一部分) */
+    tlb_shootdown(myproc(), 0, TRAPFRAME);
+    return ret;
 }
 
-// 在用户页表和进程mmap链里 新增mmap区域 [begin, begin + npages * PGSIZE)
+// 解除p的页表中 [begin, end) 的映射, 释放物理页, 然后刷新所有hart的TLB
+// 释放了页表页时按地址刷新不够, 整体刷新p的ASID(范围超过 ASID_FLUSH_PAGES 即整体刷新)
+static void unmap_flush(proc_t* p, uint64 begin, uint64 end)
+{
+    if(vm_unmappages(p->pgtbl, begin, end - begin, true))
+        tlb_shootdown(p, 0, TRAPFRAME);
+    else
+        tlb_shootdown(p, begin, end);
+}
+
+// 在进程的mmap区域树里 新增mmap区域 [begin, begin + npages * PGSIZE)
 // 页面权限为perm
-void uvm_mmap(uint64 begin, uint32 npages, int perm)
+// 私有区域只记录区域, 页面在第一次访问时由 uvm_fault 分配
+// 共享区域(MAP_SHARED)马上分配所有页面, 这样fork之后父子进程看到的是同一组物理页
+// 调用者保证不与已有区域重叠
+// 成功返回0, 内存不足返回-1
+int uvm_mmap(uint64 begin, uint32 npages, int perm, int flags)
 {
-    if(npages == 0) return;
+    if(npages == 0) return 0;
     assert(begin % PGSIZE == 0, "uvm_mmap: begin not aligned");
 
     proc_t* p = myproc();
-    
-    /* 修改 mmap 链 */
-    mmap_region_t* new_region = mmap_region_alloc();
-    new_region->begin = begin;
-    new_region->npages = npages;
-    new_region->next = NULL;
-    
-    if(p->mmap == NULL) {
-        p->mmap = new_region;
-    } else {
-        mmap_region_t* prev = NULL;
-        mmap_region_t* curr = p->mmap;
-        
-        while(curr != NULL && curr->begin < begin) {
-            prev = curr;
-            curr = curr->next;
-        }
-        
-        if(prev == NULL) {
-            new_region->next = p->mmap;
-            p->mmap = new_region;
-        } else {
-            new_region->next = curr;
-            prev->next = new_region;
+    uint64 end = begin + (uint64)npages * PGSIZE;
+
+    if(flags & MAP_SHARED) {
+        for(uint64 va = begin; va < end; va += PGSIZE) {
+            uint64 pa = (uint64)pmem_alloc_pages(0, PMEM_USER);
+            if(pa == 0) {
+                if(va > begin)
+                    unmap_flush(p, begin, va);
+                return -1;
+            }
+            vm_mappages(p->pgtbl, va, pa, PGSIZE, perm);
         }
     }
 
-    /* 修改页表 */
-    for(uint32 i = 0; i < npages; i++) {
-        uint64 va = begin + i * PGSIZE;
-        uint64 pa = (uint64)pmem_alloc(PMEM_USER);
-        vm_mappages(p->pgtbl, va, pa, PGSIZE, perm);
+    if(mmap_insert(&p->mmap, begin, npages, perm, flags) < 0) {
+        if(flags & MAP_SHARED)
+            unmap_flush(p, begin, end);
+        return -1;
     }
+    return 0;
 }
 
-// 在用户页表和进程mmap链里释放mmap区域 [begin, begin + npages * PGSIZE)
-void uvm_munmap(uint64 begin, uint32 npages)
+// 在用户页表和进程的mmap区域树里释放mmap区域 [begin, begin + npages * PGSIZE)
+// 成功返回0, 内存不足(需要拆分区域时)返回-1, 此时什么都没有释放
+int uvm_munmap(uint64 begin, uint32 npages)
 {
-    if(npages == 0) return;
+    if(npages == 0) return 0;
     assert(begin % PGSIZE == 0, "uvm_munmap: begin not aligned");
 
     proc_t* p = myproc();
-    uint64 end = begin + npages * PGSIZE;
+    uint64 end = begin + (uint64)npages * PGSIZE;
     
-    /* 处理 mmap 链 */
-    mmap_region_t* prev = NULL;
-    mmap_region_t* curr = p->mmap;
-    
-    while(curr != NULL) {
-        uint64 curr_begin = curr->begin;
-        uint64 curr_end = curr->begin + curr->npages * PGSIZE;
-        
-        if(curr_end <= begin || curr_begin >= end) {
-            prev = curr;
-            curr = curr->next;
-            continue;
-        }
-        
-        if(begin <= curr_begin && end >= curr_end) {
-            if(prev == NULL) {
-                p->mmap = curr->next;
-            } else {
-                prev->next = curr->next;
+    /* 修改区域树 */
+    if(mmap_remove(&p->mmap, begin, end) < 0)
+        return -1;
+
+    /* 页表释放 */
+    unmap_flush(p, begin, end);
+    return 0;
+}
+
+// 给 [begin, end) 内还没有映射的页面分配清零的物理页, 按perm映射
+// write = true 时顺便给写时复制的页面复制一份私有副本
+// 每个低级页表只查找一次, 然后连续填写其中的PTE
+// 成功返回0, 内存不足返回-1(已经填好的页面保留)
+static int populate_range(pgtbl_t pgtbl, uint64 begin, uint64 end, int perm, bool write)
+{
+    uint64 va = begin;
+
+    while(va < end) {
+        pte_t* pte = vm_getpte(pgtbl, va, true);
+        if(pte == NULL)
+            return -1;
+        uint64 n = PGSIZE / sizeof(pte_t) - VA_TO_VPN(va, 0);
+        if(n > (end - va) / PGSIZE)
+            n = (end - va) / PGSIZE;
+
+        for(uint64 i = 0; i < n; i++, va += PGSIZE) {
+            if(pte[i] & (PTE_V | PTE_PROTNONE)) {
+                if(write && (pte[i] & PTE_COW) && uvm_cow_fault(pgtbl, va) < 0)
+                    return -1;
+                continue;
             }
-            mmap_region_t* to_free = curr;
-            curr = curr->next;
-            mmap_region_free(to_free);
-            continue;
+            uint64 pa = (uint64)pmem_alloc_pages(0, PMEM_USER);
+            if(pa == 0)
+                return -1;
+            pte[i] = PA_TO_PTE(pa) | perm | PTE_V;
         }
-        
-        if(begin <= curr_begin && end < curr_end) {
-            uint32 removed_pages = (end - curr_begin) / PGSIZE;
-            curr->begin = end;
-            curr->npages -= removed_pages;
-            prev = curr;
-            curr = curr->next;
+    }
+    return 0;
+}
+
+// 把 [begin, end) 内已经映射的页面的权限改成perm
+// 私有页面还被别的进程共享(写时复制)时, 可写权限用COW代替
+// 不可访问(没有R也没有X)的页面清除V并标记PTE_PROTNONE, 物理页和内容都保留,
+// 之后恢复权限时重新置V
+static void protect_range(pgtbl_t pgtbl, uint64 begin, uint64 end, int perm, bool shared)
+{
+    for(uint64 va = begin; va < end; va += PGSIZE) {
+        pte_t* pte = vm_getpte(pgtbl, va, false);
+        if(pte == NULL || !((*pte) & (PTE_V | PTE_PROTNONE)))
             continue;
-        }
-        
-        if(begin > curr_begin && end >= curr_end) {
-            uint32 removed_pages = (curr_end - begin) / PGSIZE;
-            curr->npages -= removed_pages;
-            prev = curr;
-            curr = curr->next;
+
+        uint64 pa = PTE_TO_PA(*pte);
+        if(!(perm & (PTE_R | PTE_X))) {
+            *pte = PA_TO_PTE(pa) | PTE_PROTNONE;
             continue;
         }
-        
-        if(begin > curr_begin && end < curr_end) {
-            mmap_region_t* new_region = mmap_region_alloc();
-            new_region->begin = end;
-            new_region->npages = (curr_end - end) / PGSIZE;
-            new_region->next = curr->next;
-            
-            curr->npages = (begin - curr_begin) / PGSIZE;
-            curr->next = new_region;
-            
-            prev = new_region;
-            curr = new_region->next;
-            continue;
+
+        int flags = perm | PTE_V | (PTE_FLAGS(*pte) & (PTE_A | PTE_D));
+        if((perm & PTE_W) && !shared && pmem_refcnt(pa) > 1)
+            flags = (flags & ~PTE_W) | PTE_COW;
+        *pte = PA_TO_PTE(pa) | flags;
+    }
+}
+
+// 对mmap区域里的 [begin, begin + npages * PGSIZE) 给出使用建议, 范围必须被区域完整覆盖
+// MADV_DONTNEED: 释放物理页但保留区域, 下次访问时重新分配清零的页面(共享区域不支持)
+// MADV_WILLNEED / MADV_POPULATE_READ: 一次性分配好所有页面
+// MADV_POPULATE_WRITE: 同上, 另外把写时复制的页面变成私有的可写页面
+// MADV_NORMAL: 什么也不做
+// 成功返回0, 范围非法或内存不足返回-1
+int uvm_madvise(uint64 begin, uint32 npages, int advice)
+{
+    if(npages == 0) return 0;
+    assert(begin % PGSIZE == 0, "uvm_madvise: begin not aligned");
+
+    proc_t* p = myproc();
+    uint64 end = begin + (uint64)npages * PGSIZE;
+    uint64 addr = begin;
+    mmap_region_t* first = mmap_find(p->mmap, begin);
+
+    for(mmap_region_t* r = first; r && addr < end; r = r->next) {
+        if(r->begin > addr)
+            return -1;
+        if(advice == MADV_DONTNEED && (r->flags & MAP_SHARED))
+            return -1;
+        addr = r->begin + (uint64)r->npages * PGSIZE;
+    }
+    if(addr < end)
+        return -1;
+
+    switch(advice) {
+    case MADV_NORMAL:
+        break;
+    case MADV_DONTNEED:
+        unmap_flush(p, begin, end);
+        break;
+    case MADV_WILLNEED:
+    case MADV_POPULATE_READ:
+    case MADV_POPULATE_WRITE:
+        for(mmap_region_t* r = first; r && r->begin < end; r = r->next) {
+            uint64 rb = r->begin > begin ? r->begin : begin;
+            uint64 re = r->begin + (uint64)r->npages * PGSIZE;
+            if(re > end)
+                re = end;
+            // PROT_NONE 区域没有页面可以分配
+            if(!(r->perm & (PTE_R | PTE_X)))
+                continue;
+            if(advice == MADV_POPULATE_WRITE && !(r->perm & PTE_W))
+                return -1;
+            if(populate_range(p->pgtbl, rb, re, r->perm, advice == MADV_POPULATE_WRITE) < 0)
+                return -1;
         }
-        
-        prev = curr;
-        curr = curr->next;
+        break;
+    default:
+        return -1;
     }
+    return 0;
+}
 
-    /* 页表释放 */
-    vm_unmappages(p->pgtbl, begin, npages * PGSIZE, true);
+// 修改 [begin, begin + npages * PGSIZE) 的页面权限为perm
+// 范围必须完整落在 代码段和堆 或者 mmap区域 里
+// 代码段和堆没有区域记录权限, 先分配好所有页面再修改, 之后的缺页不会落到这段范围
+// (brk缩小再增长得到的新页面恢复成可读写)
+// mmap区域按需拆分合并, 之后的缺页按新权限映射
+// 成功返回0, 范围非法或内存不足返回-1
+int uvm_mprotect(uint64 begin, uint32 npages, int perm)
+{
+    if(npages == 0) return 0;
+    assert(begin % PGSIZE == 0, "uvm_mprotect: begin not aligned");
+
+    proc_t* p = myproc();
+    uint64 end = begin + (uint64)npages * PGSIZE;
+
+    if(begin >= PGSIZE && end <= PG_ROUND_UP(p->heap_top)) {
+        for(uint64 va = begin; va < end; va += PGSIZE) {
+            pte_t* pte = vm_getpte(p->pgtbl, va, false);
+            if(pte != NULL && ((*pte) & (PTE_V | PTE_PROTNONE)))
+                continue;
+            uint64 pa = (uint64)pmem_alloc_pages(0, PMEM_USER);
+            if(pa == 0)
+                return -1;
+            vm_mappages(p->pgtbl, va, pa, PGSIZE, PTE_R | PTE_W | PTE_U);
+        }
+        protect_range(p->pgtbl, begin, end, perm, false);
+    } else {
+        if(mmap_protect(&p->mmap, begin, end, perm) < 0)
+            return -1;
+
+        // 合并之后区域可能超出 [begin, end), 按区域逐段修改页表
+        for(mmap_region_t* r = mmap_find(p->mmap, begin); r && r->begin < end; r = r->next) {
+            uint64 rb = r->begin > begin ? r->begin : begin;
+            uint64 re = r->begin + (uint64)r->npages * PGSIZE;
+            protect_range(p->pgtbl, rb, re < end ? re : end, perm,
+                          (r->flags & MAP_SHARED) != 0);
+        }
+    }
+
+    tlb_shootdown(p, begin, end);
+    return 0;
 }
 
 // 用户堆空间增加
-uint64 uvm_heap_grow(pgtbl_t pgtbl, uint64 heap_top, uint32 len)
+// 只移动堆顶, 页面在第一次访问时由 uvm_fault 分配
+uint64 uvm_heap_grow(pgtbl_t pgtbl, uint64 heap_top, uint64 len)
 {
     uint64 new_heap_top = heap_top + len;
-    uint64 heap_top_aligned = PG_ROUND_UP(heap_top);
-    uint64 new_heap_top_aligned = PG_ROUND_UP(new_heap_top);
     
-    if(new_heap_top_aligned >= TRAPFRAME - 256 * PGSIZE) {
+    if(PG_ROUND_UP(new_heap_top) > MMAP_BEGIN) {
         return -1;
     }
-    
-    if(new_heap_top_aligned > heap_top_aligned) {
-        uint64 npages = (new_heap_top_aligned - heap_top_aligned) / PGSIZE;
-        for(uint64 i = 0; i < npages; i++) {
-            uint64 va = heap_top_aligned + i * PGSIZE;
-            uint64 pa = (uint64)pmem_alloc(PMEM_USER);
-            vm_mappages(pgtbl, va, pa, PGSIZE, PTE_R | PTE_W | PTE_U);
-        }
-    }
 
     return new_heap_top;
 }
 
 // 用户堆空间减少
-uint64 uvm_heap_ungrow(pgtbl_t pgtbl, uint64 heap_top, uint32 len)
+uint64 uvm_heap_ungrow(pgtbl_t pgtbl, uint64 heap_top, uint64 len)
 {
     if(len >= heap_top) {
         return 0;
@@ -250,15 +472,113 @@ uint64 uvm_heap_ungrow(pgtbl_t pgtbl, uint64 heap_top, uint32 len)
     uint64 new_heap_top_aligned = PG_ROUND_UP(new_heap_top);
     
     if(new_heap_top_aligned < heap_top_aligned) {
-        uint64 npages = (heap_top_aligned - new_heap_top_aligned) / PGSIZE;
-        vm_unmappages(pgtbl, new_heap_top_aligned, npages * PGSIZE, true);
+        unmap_flush(myproc(), new_heap_top_aligned, heap_top_aligned);
     }
 
     return new_heap_top;
 }
 
-// 其他函数保持不变...
-void uvm_copyin(pgtbl_t pgtbl, uint64 dst, uint64 src, uint32 len)
+#if KERNEL_IN_UPGTBL
+
+/*
+    用户页表里同时映射了内核, 打开 sstatus.SUM 后内核可以直接访问用户地址
+    拷贝函数在 uaccess.S 里, 访问非法地址时由 trap_kernel_handler 修复并返回-1
+    按需分配和写时复制的页面在 trap_kernel_handler 里处理
+    pgtbl 必须是当前正在使用的页表(即 myproc()->pgtbl)
+*/
+
+// in uaccess.S
+extern int uaccess_copy(uint64 dst, uint64 src, uint64 len);
+extern int uaccess_copy_str(uint64 dst, uint64 src, uint64 maxlen);
+
+// 用户空间 => 内核空间
+// 成功返回0, 用户地址非法返回-1
+int uvm_copyin(pgtbl_t pgtbl, uint64 dst, uint64 src, uint32 len)
+{
+    if(len == 0)
+        return 0;
+    // 不检查的话用户可以借系统调用读写内核地址
+    if(!uvm_range_ok(src, src + len))
+        return -1;
+
+    w_sstatus(r_sstatus() | SSTATUS_SUM);
+    int ret = uaccess_copy(dst, src, len);
+    w_sstatus(r_sstatus() & ~SSTATUS_SUM);
+    return ret;
+}
+
+// 内核空间 => 用户空间
+// 成功返回0, 用户地址非法返回-1
+int uvm_copyout(pgtbl_t pgtbl, uint64 dst, uint64 src, uint32 len)
+{
+    if(len == 0)
+        return 0;
+    if(!uvm_range_ok(dst, dst + len))
+        return -1;
+
+    w_sstatus(r_sstatus() | SSTATUS_SUM);
+    int ret = uaccess_copy(dst, src, len);
+    w_sstatus(r_sstatus() & ~SSTATUS_SUM);
+    return ret;
+}
+
+// 用户空间的字符串 => 内核空间
+// 成功返回0, 用户地址非法返回-1
+int uvm_copyin_str(pgtbl_t pgtbl, uint64 dst, uint64 src, uint32 maxlen)
+{
+    if(maxlen == 0)
+        return 0;
+    // 字符串可能比maxlen短, 起点合法即可, 最多读到合法范围的末尾
+    if(!uvm_range_ok(src, src + 1))
+        return -1;
+    uint64 limit = kvm_user_limit(src);
+    if(limit > TRAPFRAME)
+        limit = TRAPFRAME;
+    if(maxlen > limit - src)
+        maxlen = limit - src;
+
+    w_sstatus(r_sstatus() | SSTATUS_SUM);
+    int ret = uaccess_copy_str(dst, src, maxlen);
+    w_sstatus(r_sstatus() & ~SSTATUS_SUM);
+    return ret;
+}
+
+#else
+
+/*
+    内核使用独立的页表, 只能先把用户地址翻译成物理地址再拷贝
+*/
+
+// 找到用户地址va对应的pte, 还没有分配的页面先按缺页处理
+// write = true 时同时解除写时复制
+// 非法地址(包括没有PTE_U的trapframe等)返回NULL
+static pte_t* user_pte(pgtbl_t pgtbl, uint64 va, bool write)
+{
+    if(va >= VA_MAX)
+        return NULL;
+
+    pte_t* pte = vm_getpte(pgtbl, va, false);
+    if(pte == NULL || !((*pte) & PTE_V)) {
+        if(uvm_fault(va, write) != 0)
+            return NULL;
+        pte = vm_getpte(pgtbl, va, false);
+    } else if(write && ((*pte) & PTE_COW)) {
+        if(uvm_cow_fault(pgtbl, va) != 0)
+            return NULL;
+    }
+
+    if(!((*pte) & PTE_U))
+        return NULL;
+    if(!write && !((*pte) & PTE_R))
+        return NULL;
+    if(write && !((*pte) & PTE_W))
+        return NULL;
+    return pte;
+}
+
+// 用户空间 => 内核空间 (页面可能需要按需分配)
+// 成功返回0, 用户地址非法返回-1
+int uvm_copyin(pgtbl_t pgtbl, uint64 dst, uint64 src, uint32 len)
 {
     char* dst_ptr = (char*)dst;
     uint64 src_va = src;
@@ -272,8 +592,9 @@ void uvm_copyin(pgtbl_t pgtbl, uint64 dst, uint64 src, uint32 len)
             copy_len = remaining;
         }
         
-        pte_t* pte = vm_getpte(pgtbl, src_va, false);
-        assert(pte != NULL && ((*pte) & PTE_V), "uvm_copyin: invalid address");
+        pte_t* pte = user_pte(pgtbl, src_va, false);
+        if(pte == NULL)
+            return -1;
         
         uint64 pa = PTE_TO_PA(*pte);
         char* src_ptr = (char*)(pa + offset_in_page);
@@ -284,9 +605,12 @@ void uvm_copyin(pgtbl_t pgtbl, uint64 dst, uint64 src, uint32 len)
         src_va += copy_len;
         remaining -= copy_len;
     }
+    return 0;
 }
 
-void uvm_copyout(pgtbl_t pgtbl, uint64 dst, uint64 src, uint32 len)
+// 内核空间 => 用户空间
+// 成功返回0, 用户地址非法返回-1
+int uvm_copyout(pgtbl_t pgtbl, uint64 dst, uint64 src, uint32 len)
 {
     char* src_ptr = (char*)src;
     uint64 dst_va = dst;
@@ -300,8 +624,10 @@ void uvm_copyout(pgtbl_t pgtbl, uint64 dst, uint64 src, uint32 len)
             copy_len = remaining;
         }
         
-        pte_t* pte = vm_getpte(pgtbl, dst_va, false);
-        assert(pte != NULL && ((*pte) & PTE_V), "uvm_copyout: invalid address");
+        // 内核代替用户写入, 同样需要先解除共享
+        pte_t* pte = user_pte(pgtbl, dst_va, true);
+        if(pte == NULL)
+            return -1;
         
         uint64 pa = PTE_TO_PA(*pte);
         char* dst_ptr = (char*)(pa + offset_in_page);
@@ -312,9 +638,12 @@ void uvm_copyout(pgtbl_t pgtbl, uint64 dst, uint64 src, uint32 len)
         dst_va += copy_len;
         remaining -= copy_len;
     }
+    return 0;
 }
 
-void uvm_copyin_str(pgtbl_t pgtbl, uint64 dst, uint64 src, uint32 maxlen)
+// 用户空间的字符串 => 内核空间
+// 成功返回0, 用户地址非法返回-1
+int uvm_copyin_str(pgtbl_t pgtbl, uint64 dst, uint64 src, uint32 maxlen)
 {
     char* dst_ptr = (char*)dst;
     uint64 src_va = src;
@@ -324,8 +653,9 @@ void uvm_copyin_str(pgtbl_t pgtbl, uint64 dst, uint64 src, uint32 maxlen)
         uint64 src_page_base = PG_ROUND_DOWN(src_va);
         uint64 offset_in_page = src_va - src_page_base;
         
-        pte_t* pte = vm_getpte(pgtbl, src_va, false);
-        assert(pte != NULL && ((*pte) & PTE_V), "uvm_copyin_str: invalid address");
+        pte_t* pte = user_pte(pgtbl, src_va, false);
+        if(pte == NULL)
+            return -1;
         
         uint64 pa = PTE_TO_PA(*pte);
         char* src_ptr = (char*)(pa + offset_in_page);
@@ -333,7 +663,7 @@ void uvm_copyin_str(pgtbl_t pgtbl, uint64 dst, uint64 src, uint32 maxlen)
         while(offset_in_page < PGSIZE && copied < maxlen) {
             *dst_ptr = *src_ptr;
             if(*src_ptr == '\0') {
-                return;
+                return 0;
             }
             dst_ptr++;
             src_ptr++;
@@ -343,7 +673,10 @@ void uvm_copyin_str(pgtbl_t pgtbl, uint64 dst, uint64 src, uint32 maxlen)
         }
     }
     
-    if(copied == maxlen) {
+    if(copied == maxlen && maxlen > 0) {
         *(dst_ptr - 1) = '\0';
     }
-}
\ No newline at end of file
+    return 0;
+}
+
+#endif
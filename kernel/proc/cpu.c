@@ -19,6 +19,12 @@ int mycpuid(void)
     return id;
 }
 
+// 获取编号为id的CPU结构体
+cpu_t* getcpu(int id)
+{
+    return &cpus[id];
+}
+
 // 获取当前CPU上运行的进程
 proc_t* myproc(void)
 {
@@ -3,8 +3,12 @@
 #include "mem/pmem.h"
 #include "mem/vmem.h"
 #include "mem/mmap.h"
+#include "mem/kmem.h"
+#include "dev/timer.h"
 #include "proc/cpu.h"
+#include "proc/waitq.h"
 #include "proc/initcode.h"
+#include "lib/heap.h"
 #include "memlayout.h"
 #include "riscv.h"
 #include "common.h"
@@ -22,8 +26,14 @@ extern void trap_user_return();
 
 /*----------------本地变量------------------*/
 
-// 进程数组
-proc_t proc[NPROC];  // 改成全局数组，与模板一致
+/*
+    进程控制块从 proc_cache 申请, 没有数量上限
+    所有申请过的进程串成一条只增不减的链表 proc_list, 退出的进程标记为UNUSED后留在链上复用
+    这样遍历链表时不用担心节点被释放, 新节点插在链头并用内存屏障发布
+*/
+static kmem_cache_t* proc_cache;
+static proc_t* proc_list;
+static spinlock_t proc_list_lk;
 
 // 第一个进程的指针
 static proc_t* proczero;
@@ -35,6 +45,132 @@ static spinlock_t pid_lock;
 // wait的自旋锁
 static spinlock_t wait_lock;
 
+/*
+    每个hart一个运行队列, 里面是状态为RUNNABLE的进程
+    队列按虚拟运行时间(vruntime)组织成左偏堆, 每次取vruntime最小的进程运行, O(log n)
+
+    进程运行的实际时间(mtime)按nice值对应的权重折算成vruntime:
+    vruntime += 实际时间 * NICE_0_WEIGHT / weight, 权重越大vruntime涨得越慢, 分到的CPU越多
+    nice值每差1, 权重大约差1.25倍(和Linux CFS的表相同)
+
+    每个队列记录单调不减的 min_vruntime, 进程入队时vruntime至少是min_vruntime,
+    这样睡了很久的进程醒来后不会靠积攒的vruntime长时间霸占CPU
+
+    进程变成RUNNABLE时放进它上一次运行的hart的队列(缓存还是热的), 没运行过的放进当前hart的队列
+    hart的队列空了就从最长的队列里偷vruntime最小的进程, 它的vruntime换算成本hart的min_vruntime
+    检查别的队列时先不加锁看一眼长度, 调度开销只和可运行进程的数量有关
+
+    锁的顺序: p->lk -> rq->lk
+    调度器从队列取出进程后先放开队列的锁再获取p->lk,
+    这时进程可能还没有切换出去(p->lk还被原来的hart持有), 获取p->lk会等到它切换完成
+*/
+typedef struct runq {
+    spinlock_t lk;
+    heap_node_t* root;       // 按vruntime排序的左偏堆
+    volatile int n;          // 队列长度(不加锁读取时只作为参考)
+    uint64 min_vruntime;     // 单调不减
+} runq_t;
+
+static runq_t runq[NCPU];
+
+#define NICE_0_WEIGHT 1024
+
+// nice值 -20 ... 19 对应的权重
+static const uint32 nice_to_weight[NICE_MAX - NICE_MIN + 1] = {
+ /* -20 */ 88761, 71755, 56483, 46273, 36291,
+ /* -15 */ 29154, 23254, 18705, 14949, 11916,
+ /* -10 */  9548,  7620,  6100,  4904,  3906,
+ /*  -5 */  3121,  2501,  1991,  1586,  1277,
+ /*   0 */  1024,   820,   655,   526,   423,
+ /*   5 */   335,   272,   215,   172,   137,
+ /*  10 */   110,    87,    70,    56,    45,
+ /*  15 */    36,    29,    23,    18,    15,
+};
+
+static bool vruntime_less(heap_node_t* a, heap_node_t* b)
+{
+    return heap_entry(a, proc_t, rq_node)->vruntime < heap_entry(b, proc_t, rq_node)->vruntime;
+}
+
+// 把正在运行的进程p从 exec_start 到现在的运行时间折算进vruntime(持有p->lk)
+// 必须在p进入运行队列之前调用: 堆里的进程只能在持有rq->lk时修改vruntime
+static void charge_vruntime(proc_t* p)
+{
+    uint64 now = timer_mtime();
+
+    p->vruntime += (now - p->exec_start) * NICE_0_WEIGHT / nice_to_weight[p->nice - NICE_MIN];
+    p->exec_start = now;
+}
+
+// 进程入队(持有rq->lk)
+static void rq_push(runq_t* rq, proc_t* p)
+{
+    if(p->vruntime < rq->min_vruntime)
+        p->vruntime = rq->min_vruntime;
+    rq->root = heap_insert(rq->root, &p->rq_node, vruntime_less);
+    rq->n++;
+}
+
+// 从hart的运行队列里取出vruntime最小的进程
+static proc_t* rq_pop(int hart)
+{
+    runq_t* rq = &runq[hart];
+    proc_t* p = NULL;
+
+    if(rq->n == 0)
+        return NULL;
+
+    spinlock_acquire(&rq->lk);
+    if(rq->root) {
+        p = heap_entry(rq->root, proc_t, rq_node);
+        rq->root = heap_pop(rq->root, vruntime_less);
+        rq->n--;
+        if(p->vruntime > rq->min_vruntime)
+            rq->min_vruntime = p->vruntime;
+    }
+    spinlock_release(&rq->lk);
+    return p;
+}
+
+// 进程变成RUNNABLE并放进运行队列(持有p->lk)
+void proc_runnable(proc_t* p)
+{
+    int hart = p->last_cpu >= 0 ? p->last_cpu : mycpuid();
+    runq_t* rq = &runq[hart];
+
+    // 当前进程让出CPU: 先按旧的位置记账, 再带着新的vruntime入队
+    if(p->state == RUNNING)
+        charge_vruntime(p);
+    p->state = RUNNABLE;
+    spinlock_acquire(&rq->lk);
+    rq_push(rq, p);
+    spinlock_release(&rq->lk);
+}
+
+// 选出本hart下一个要运行的进程: 先看自己的队列, 再从最长的队列里偷
+// 偷来的进程 *stolen = true, 由调用者在持有p->lk时换算vruntime
+static proc_t* proc_pick(int id, bool* stolen)
+{
+    proc_t* p = rq_pop(id);
+    *stolen = false;
+    if(p)
+        return p;
+
+    int victim = -1, most = 0;
+    for(int i = 0; i < NCPU; i++) {
+        if(i != id && runq[i].n > most) {
+            most = runq[i].n;
+            victim = i;
+        }
+    }
+    if(victim < 0)
+        return NULL;
+
+    p = rq_pop(victim);
+    *stolen = (p != NULL);
+    return p;
+}
+
 // 申请一个pid(锁保护)
 static int allocpid()
 {
@@ -55,13 +191,41 @@ static void fork_return()
     trap_user_return();
 }
 
+// 新申请一个进程控制块并挂到 proc_list 上
+// 成功时返回持有锁的进程, 失败返回NULL
+static proc_t* proc_grow()
+{
+    proc_t* p = kmem_cache_alloc(proc_cache);
+    if(p == NULL)
+        return NULL;
+
+    // 内核栈映射在 KSTACK 区域(带guard page), 进程控制块复用时内核栈跟着复用
+    p->kstack = kvm_kstack_alloc();
+    if(p->kstack == 0) {
+        kmem_cache_free(proc_cache, p);
+        return NULL;
+    }
+
+    spinlock_init(&p->lk, "proc");
+    p->state = UNUSED;
+    spinlock_acquire(&p->lk);
+
+    spinlock_acquire(&proc_list_lk);
+    p->next = proc_list;
+    __sync_synchronize();
+    proc_list = p;
+    spinlock_release(&proc_list_lk);
+
+    return p;
+}
+
 // 返回一个未使用的进程空间
 proc_t* proc_alloc()
 {
     proc_t* p;
     
     // 查找一个UNUSED状态的进程槽
-    for(p = proc; p < &proc[NPROC]; p++) {
+    for(p = proc_list; p != NULL; p = p->next) {
         spinlock_acquire(&p->lk);
         if(p->state == UNUSED) {
             goto found;  // 找到后跳出，持有锁
@@ -69,15 +233,30 @@ proc_t* proc_alloc()
             spinlock_release(&p->lk);
         }
     }
-    return 0;  // 没有空闲进程槽
+
+    // 没有空闲进程槽就新申请一个
+    p = proc_grow();
+    if(p == NULL)
+        return 0;
     
 found:
     // 分配pid
     p->pid = allocpid();
-    p->state = RUNNABLE;
+    p->state = USED;
+    p->last_cpu = -1;
+    p->slice_ticks = 0;
+    p->run_ticks = 0;
+    p->preempt_count = 0;
+    p->nice = 0;
+    p->vruntime = 0;
+
+    // ASID在第一次返回用户态时分配
+    p->asid = 0;
+    p->cpus_ran = 0;
+    p->tlb_pending = 0;
     
-    // 分配trapframe物理页
-    p->tf = (trapframe_t*)pmem_alloc(PMEM_USER);
+    // 分配trapframe(独占一页, 映射到用户页表的 TRAPFRAME)
+    p->tf = (trapframe_t*)pmem_alloc_pages(0, PMEM_USER);
     if(p->tf == 0) {
         proc_free(p);
         spinlock_release(&p->lk);
@@ -92,9 +271,6 @@ found:
         return 0;
     }
     
-    // 设置内核栈地址
-    p->kstack = KSTACK((int)(p - proc));
-    
     // 设置context
     memset(&p->ctx, 0, sizeof(context_t));
     p->ctx.ra = (uint64)fork_return;
@@ -114,13 +290,8 @@ void proc_free(proc_t* p)
         uvm_destroy_pgtbl(p->pgtbl);
     p->pgtbl = 0;
     
-    // 释放mmap区域链表
-    mmap_region_t* curr = p->mmap;
-    while(curr != NULL) {
-        mmap_region_t* next = curr->next;
-        mmap_region_free(curr);
-        curr = next;
-    }
+    // 释放mmap区域树
+    mmap_destroy(p->mmap);
     p->mmap = NULL;
     
     // 重置其他字段
@@ -131,40 +302,56 @@ void proc_free(proc_t* p)
     p->sleep_space = NULL;
     p->heap_top = 0;
     p->ustack_pages = 0;
-    p->kstack = 0;
     memset(&p->ctx, 0, sizeof(context_t));
 }
 
 // 进程模块初始化
 void proc_init()
 {
-    proc_t* p;
-    
     spinlock_init(&pid_lock, "nextpid");
     spinlock_init(&wait_lock, "wait_lock");
-    
-    for(p = proc; p < &proc[NPROC]; p++) {
-        spinlock_init(&p->lk, "proc");
-        p->state = UNUSED;
-        p->kstack = KSTACK((int)(p - proc));
+    spinlock_init(&proc_list_lk, "proc_list");
+    for(int i = 0; i < NCPU; i++) {
+        spinlock_init(&runq[i].lk, "runq");
+        runq[i].root = NULL;
+        runq[i].n = 0;
+        runq[i].min_vruntime = 0;
     }
+    waitq_hash_init();
+    
+    proc_cache = kmem_cache_create("proc", sizeof(proc_t));
+    proc_list = NULL;
     
     printf("proc_init: process system initialized\n");
 }
 
 // 获得一个初始化过的用户页表
+// 内存不足返回0
 pgtbl_t proc_pgtbl_init(uint64 trapframe)
 {
-    pgtbl_t pgtbl = (pgtbl_t)pmem_alloc(PMEM_KERNEL);
+    pgtbl_t pgtbl = (pgtbl_t)pmem_alloc_pages(0, PMEM_KERNEL);
     if(pgtbl == 0)
         return 0;
-    memset(pgtbl, 0, PGSIZE);
+
+    // trampoline和trapframe在同一个低级页表里, 先建好它, 之后的映射不会再申请页表页
+    if(vm_getpte(pgtbl, TRAPFRAME, true) == NULL) {
+        uvm_destroy_pgtbl(pgtbl);
+        return 0;
+    }
     
-    // 映射trampoline页
-    vm_mappages(pgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
+    // 映射trampoline页(和内核页表里的映射相同, 也是全局映射)
+    vm_mappages(pgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X | PTE_G);
     
     // 映射trapframe页
     vm_mappages(pgtbl, TRAPFRAME, trapframe, PGSIZE, PTE_R | PTE_W);
+
+#if KERNEL_IN_UPGTBL
+    // 内核映射(无PTE_U)
+    if(kvm_share(pgtbl) < 0) {
+        uvm_destroy_pgtbl(pgtbl);
+        return 0;
+    }
+#endif
     
     return pgtbl;
 }
@@ -188,21 +375,19 @@ void proc_make_first()
     if(mem == 0) {
         panic("proc_make_first: code alloc failed");
     }
-    memset(mem, 0, PGSIZE);
     
     // 代码段从 PGSIZE 开始
     vm_mappages(p->pgtbl, PGSIZE, (uint64)mem, PGSIZE, 
                 PTE_W | PTE_R | PTE_X | PTE_U);
     memmove(mem, initcode, initcode_len);
     
-    // 映射用户栈（在高地址）
+    // 映射用户栈（紧挨着trapframe, 之后按需向下增长）
     uint64 ustack_phys = (uint64)pmem_alloc(PMEM_USER);
     if(ustack_phys == 0) {
         panic("proc_make_first: stack alloc failed");
     }
     
-    // 用户栈的虚拟地址（在用户地址空间的高处）
-    uint64 stack_va = PGSIZE * 10;  // 不要用 kstack 来计算！
+    uint64 stack_va = TRAPFRAME - PGSIZE;
     vm_mappages(p->pgtbl, stack_va, ustack_phys, PGSIZE, 
                 PTE_R | PTE_W | PTE_U);
     
@@ -219,7 +404,7 @@ void proc_make_first()
     printf("proc_make_first: code at 0x%x, stack at 0x%lx, sp=0x%lx\n",
            PGSIZE, stack_va, p->tf->sp);
     
-    p->state = RUNNABLE;
+    proc_runnable(p);
     spinlock_release(&p->lk);
     
     printf("proc_make_first: first process created (pid=%d)\n", p->pid);
@@ -242,30 +427,30 @@ int proc_fork()
     
     printf("[fork] child pid=%d allocated\n", child->pid);
     
+    // 深拷贝 mmap (放在页表之前, 失败时父进程的页表还没有被修改)
+    if(mmap_dup(parent->mmap, &child->mmap) < 0) {
+        proc_free(child);
+        spinlock_release(&child->lk);
+        return -1;
+    }
+    
     // 拷贝用户页表 (注意：参数顺序是 old, new)
-    uvm_copy_pgtbl(parent->pgtbl, child->pgtbl, parent->heap_top, 
-                   parent->ustack_pages, parent->mmap);
+    // 写时复制, 耗时只与实际映射的页面数量有关
+    if(uvm_copy_pgtbl(parent->pgtbl, child->pgtbl, parent->heap_top, 
+                      parent->ustack_pages, parent->mmap) < 0) {
+        proc_free(child);
+        spinlock_release(&child->lk);
+        return -1;
+    }
     
     printf("[fork] child pid=%d page table copied\n", child->pid);
     
     child->heap_top = parent->heap_top;
     child->ustack_pages = parent->ustack_pages;
-    
-    // 深拷贝 mmap
-    mmap_region_t* parent_mmap = parent->mmap;
-    mmap_region_t** child_mmap_ptr = &child->mmap;
-    
-    while(parent_mmap != NULL) {
-        mmap_region_t* new_region = mmap_region_alloc();
-        new_region->begin = parent_mmap->begin;
-        new_region->npages = parent_mmap->npages;
-        new_region->next = NULL;
-        
-        *child_mmap_ptr = new_region;
-        child_mmap_ptr = &new_region->next;
-        
-        parent_mmap = parent_mmap->next;
-    }
+
+    // 子进程继承nice值, 从父进程当前的vruntime开始
+    child->nice = parent->nice;
+    child->vruntime = parent->vruntime;
     
     // 拷贝trapframe
     *(child->tf) = *(parent->tf);
@@ -283,7 +468,7 @@ int proc_fork()
     spinlock_release(&wait_lock);
     
     spinlock_acquire(&child->lk);
-    child->state = RUNNABLE;
+    proc_runnable(child);
     spinlock_release(&child->lk);
     
     return pid;
@@ -294,7 +479,7 @@ void proc_yield()
 {
     proc_t* p = myproc();
     spinlock_acquire(&p->lk);
-    p->state = RUNNABLE;
+    proc_runnable(p);
     proc_sched();
     spinlock_release(&p->lk);
 }
@@ -310,15 +495,18 @@ int proc_wait(uint64 addr)
     
     for(;;) {
         havekids = 0;
-        for(pp = proc; pp < &proc[NPROC]; pp++) {
+        for(pp = proc_list; pp != NULL; pp = pp->next) {
             if(pp->parent == p) {
                 spinlock_acquire(&pp->lk);
                 
                 havekids = 1;
                 if(pp->state == ZOMBIE) {
                     pid = pp->pid;
-                    if(addr != 0) {
-                        uvm_copyout(p->pgtbl, addr, (uint64)&pp->exit_state, sizeof(pp->exit_state));
+                    if(addr != 0 && uvm_copyout(p->pgtbl, addr, (uint64)&pp->exit_state,
+                                                sizeof(pp->exit_state)) < 0) {
+                        spinlock_release(&pp->lk);
+                        spinlock_release(&wait_lock);
+                        return -1;
                     }
                     proc_free(pp);
                     spinlock_release(&pp->lk);
@@ -338,23 +526,15 @@ int proc_wait(uint64 addr)
     }
 }
 
-// 唤醒一个进程
-static void proc_wakeup_one(proc_t* p)
-{
-    if(p->state == SLEEPING && p->sleep_space == p) {
-        p->state = RUNNABLE;
-    }
-}
-
 // 过继子进程
 static void proc_reparent(proc_t* parent)
 {
     proc_t* pp;
     
-    for(pp = proc; pp < &proc[NPROC]; pp++) {
+    for(pp = proc_list; pp != NULL; pp = pp->next) {
         if(pp->parent == parent) {
             pp->parent = proczero;
-            proc_wakeup_one(proczero);
+            proc_wakeup(proczero);
         }
     }
 }
@@ -370,7 +550,7 @@ void proc_exit(int exit_state)
     spinlock_acquire(&wait_lock);
     
     proc_reparent(p);
-    proc_wakeup_one(p->parent);
+    proc_wakeup(p->parent);
     
     spinlock_acquire(&p->lk);
     
@@ -397,6 +577,11 @@ void proc_sched()
         panic("sched running");
     if(intr_get())
         panic("sched interruptible");
+
+    // 睡眠和退出的进程不在运行队列里, 在这里记账
+    // 让出CPU的进程已经在 proc_runnable 里记过账并且入队了, 不能再动它的vruntime
+    if(p->state != RUNNABLE)
+        charge_vruntime(p);
     
     origin = mycpu()->origin;
     swtch(&p->ctx, &mycpu()->ctx);
@@ -404,59 +589,122 @@ void proc_sched()
 }
 
 // 调度器
+// 每次从运行队列里取一个进程运行(见proc_pick), 不再遍历所有进程
 void proc_scheduler()
 {
     proc_t* p;
+    bool stolen;
     cpu_t* c = mycpu();
+    int id = mycpuid();
     
     c->proc = 0;
     for(;;) {
         intr_on();
         
-        for(p = proc; p < &proc[NPROC]; p++) {
-            spinlock_acquire(&p->lk);
-            if(p->state == RUNNABLE) {
-                p->state = RUNNING;
-                c->proc = p;
-                swtch(&c->ctx, &p->ctx);
-                c->proc = 0;
-            }
-            spinlock_release(&p->lk);
+        p = proc_pick(id, &stolen);
+        if(p == NULL) {
+            // 没有可运行的进程, 趁空闲把缓存里的脏页清零
+            pmem_idle();
+            continue;
         }
+
+        spinlock_acquire(&p->lk);
+        assert(p->state == RUNNABLE, "proc_scheduler: not runnable");
+        // 不同队列的vruntime没有可比性, 偷来的进程从本队列的起点开始计算
+        if(stolen)
+            p->vruntime = runq[id].min_vruntime;
+        p->state = RUNNING;
+        p->last_cpu = id;
+        p->slice_ticks = 0;
+        p->exec_start = timer_mtime();
+        c->proc = p;
+#if KERNEL_IN_UPGTBL
+        // 内核也映射在用户页表里, 页表在这里切换而不是在trampoline里
+        w_satp(asid_switch(p));
+        kvm_kstack_sync();
+        swtch(&c->ctx, &p->ctx);
+        kvm_switch();
+#else
+        kvm_kstack_sync();
+        swtch(&c->ctx, &p->ctx);
+#endif
+        c->proc = 0;
+        spinlock_release(&p->lk);
     }
 }
 
-// 进程睡眠
-void proc_sleep(void* sleep_space, spinlock_t* lk)
+// 时钟中断打断了用户态的当前进程
+// 记一个tick, 用完 SCHED_QUANTUM 个tick的时间片后让出CPU
+// 进程每次被调度时重新开始计算时间片
+void proc_tick()
 {
     proc_t* p = myproc();
-    
+
+    p->run_ticks++;
+    if(++p->slice_ticks < SCHED_QUANTUM)
+        return;
+
+    p->preempt_count++;
+    proc_yield();
+}
+
+// 输出所有进程的状态(在控制台按 Ctrl-P)
+// 不加锁, 避免系统卡住时也卡住这里
+void proc_dump()
+{
+    static char* states[] = {
+        [UNUSED]    "unused",
+        [USED]      "used",
+        [RUNNABLE]  "runnable",
+        [RUNNING]   "running",
+        [SLEEPING]  "sleeping",
+        [ZOMBIE]    "zombie",
+    };
+
+    printf("\npid\tstate\tcpu\tnice\tvruntime(us)\tticks\tpreempted\n");
+    for(proc_t* p = proc_list; p != NULL; p = p->next) {
+        if(p->state == UNUSED)
+            continue;
+        printf("%d\t%s\t%d\t%d\t%d\t\t%d\t%d\n", p->pid, states[p->state],
+               p->last_cpu, p->nice, (int)(p->vruntime / (TIMER_FREQ / 1000000)),
+               (int)p->run_ticks, (int)p->preempt_count);
+    }
+}
+
+// 调整当前进程的nice值(加上inc, 结果限制在 [NICE_MIN, NICE_MAX])
+// 返回新的nice值, 下一次计算vruntime时生效
+int proc_nice(int inc)
+{
+    proc_t* p = myproc();
+    int nice;
+
     spinlock_acquire(&p->lk);
-    spinlock_release(lk);
-    
-    p->sleep_space = sleep_space;
-    p->state = SLEEPING;
-    
-    proc_sched();
-    
-    p->sleep_space = 0;
-    
+    nice = p->nice + inc;
+    if(nice < NICE_MIN)
+        nice = NICE_MIN;
+    if(nice > NICE_MAX)
+        nice = NICE_MAX;
+    p->nice = nice;
     spinlock_release(&p->lk);
-    spinlock_acquire(lk);
+
+    return nice;
 }
 
-// 唤醒所有睡眠进程
+// 进程睡眠
+// 在sleep_space对应的等待队列上睡眠(见waitq.c)
+void proc_sleep(void* sleep_space, spinlock_t* lk)
+{
+    waitq_sleep(waitq_hash(sleep_space), sleep_space, lk);
+}
+
+// 唤醒所有在sleep_space上睡眠的进程
 void proc_wakeup(void* sleep_space)
 {
-    proc_t* p;
-    
-    for(p = proc; p < &proc[NPROC]; p++) {
-        if(p != myproc()) {
-            spinlock_acquire(&p->lk);
-            if(p->state == SLEEPING && p->sleep_space == sleep_space) {
-                p->state = RUNNABLE;
-            }
-            spinlock_release(&p->lk);
-        }
-    }
-}
\ No newline at end of file
+    waitq_wake(waitq_hash(sleep_space), sleep_space, -1);
+}
+
+// 只唤醒一个在sleep_space上睡眠的进程(最早睡下的那个), 避免惊群
+void proc_wakeup_one(void* sleep_space)
+{
+    waitq_wake(waitq_hash(sleep_space), sleep_space, 1);
+}
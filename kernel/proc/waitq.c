@@ -0,0 +1,106 @@
+// wait queues for sleep/wakeup
+
+#include "proc/waitq.h"
+#include "proc/cpu.h"
+#include "lib/print.h"
+#include "common.h"
+
+// proc_sleep/proc_wakeup 使用的散列表
+static waitq_t waitq_table[WAITQ_HASH_SIZE];
+
+void waitq_init(waitq_t* wq, char* name)
+{
+    spinlock_init(&wq->lk, name);
+    wq->head = wq->tail = NULL;
+}
+
+// 当前进程在wq上睡眠, 等待chan
+// 调用者持有保护等待条件的锁lk, 睡眠期间放开, 醒来后重新获取
+// 进程在放开lk之前就已经在队列里, 修改条件后再唤醒的一方不会错过它
+void waitq_sleep(waitq_t* wq, void* chan, spinlock_t* lk)
+{
+    proc_t* p = myproc();
+
+    spinlock_acquire(&p->lk);
+
+    spinlock_acquire(&wq->lk);
+    p->sleep_space = chan;
+    p->wq_next = NULL;
+    if(wq->tail)
+        wq->tail->wq_next = p;
+    else
+        wq->head = p;
+    wq->tail = p;
+    spinlock_release(&wq->lk);
+
+    spinlock_release(lk);
+
+    p->state = SLEEPING;
+    proc_sched();
+
+    p->sleep_space = 0;
+
+    spinlock_release(&p->lk);
+    spinlock_acquire(lk);
+}
+
+// 唤醒wq上等待chan的进程, 最多nr个(nr < 0 表示全部), 先睡的先醒
+// 返回唤醒的进程数量
+int waitq_wake(waitq_t* wq, void* chan, int nr)
+{
+    proc_t* woken = NULL;
+    proc_t** tail = &woken;
+    proc_t* prev = NULL;
+    proc_t* p;
+    int n = 0;
+
+    // 摘出要唤醒的进程
+    spinlock_acquire(&wq->lk);
+    p = wq->head;
+    while(p != NULL && n != nr) {
+        proc_t* next = p->wq_next;
+        if(p->sleep_space == chan) {
+            if(prev)
+                prev->wq_next = next;
+            else
+                wq->head = next;
+            if(wq->tail == p)
+                wq->tail = prev;
+            p->wq_next = NULL;
+            *tail = p;
+            tail = &p->wq_next;
+            n++;
+        } else {
+            prev = p;
+        }
+        p = next;
+    }
+    spinlock_release(&wq->lk);
+
+    // 进程可能还没有切换出去, 获取p->lk会等到它真正睡下
+    // 唤醒之后它可能马上再次睡眠并改写wq_next, 所以先取出next
+    for(p = woken; p != NULL; ) {
+        proc_t* next = p->wq_next;
+        spinlock_acquire(&p->lk);
+        assert(p->state == SLEEPING, "waitq_wake: not sleeping");
+        proc_runnable(p);
+        spinlock_release(&p->lk);
+        p = next;
+    }
+    return n;
+}
+
+void waitq_hash_init()
+{
+    for(int i = 0; i < WAITQ_HASH_SIZE; i++)
+        waitq_init(&waitq_table[i], "waitq");
+}
+
+// channel对应的等待队列
+waitq_t* waitq_hash(void* chan)
+{
+    uint64 x = (uint64)chan;
+    x ^= x >> 6;
+    x ^= x >> 12;
+    return &waitq_table[x % WAITQ_HASH_SIZE];
+}
@@ -20,6 +20,10 @@ static uint64 (*syscalls[])(void) = {
     [SYS_wait]          sys_wait,
     [SYS_exit]          sys_exit,
     [SYS_sleep]         sys_sleep,
+    [SYS_mprotect]      sys_mprotect,
+    [SYS_madvise]       sys_madvise,
+    [SYS_nice]          sys_nice,
+    [SYS_nanosleep]     sys_nanosleep,
 };
 
 // 系统调用
@@ -82,11 +86,12 @@ void arg_uint64(int n, uint64* ip)
 }
 
 // 读取 n 号参数指向的字符串到 buf, 字符串最大长度是 maxlen
-void arg_str(int n, char* buf, int maxlen)
+// 成功返回0, 用户地址非法返回-1
+int arg_str(int n, char* buf, int maxlen)
 {
     proc_t* p = myproc();
     uint64 addr;
     arg_uint64(n, &addr);
 
-    uvm_copyin_str(p->pgtbl, (uint64)buf, addr, maxlen);
+    return uvm_copyin_str(p->pgtbl, (uint64)buf, addr, maxlen);
 }
\ No newline at end of file
@@ -31,22 +31,25 @@ uint64 sys_brk(void) {
     uint64 old_heap_top = p->heap_top;
     uint64 new_heap_top = PG_ROUND_UP(arg0);
     
-    // 检查是否超过最大堆大小
-    uint64 max_heap = TRAPFRAME - p->ustack_pages * PGSIZE - PGSIZE;
-    if(new_heap_top > max_heap) {
+    // 检查是否超过最大堆大小(堆不能进入mmap区域, 也不能覆盖内核的全局映射)
+    if(new_heap_top > MMAP_BEGIN || !uvm_range_ok(0, new_heap_top)) {
         return -1;
     }
     
     if(new_heap_top > old_heap_top) {
-        // 增长堆
-        uint32 len = new_heap_top - old_heap_top;
-        if(uvm_heap_grow(p->pgtbl, old_heap_top, len) < 0) {
+        // 增长堆(不能长进已有的mmap区域)
+        if(mmap_overlap(p->mmap, old_heap_top, new_heap_top)) {
+            return -1;
+        }
+        // 堆最大可以到 MMAP_BEGIN, 长度可能超过4GB
+        uint64 len = new_heap_top - old_heap_top;
+        if(uvm_heap_grow(p->pgtbl, old_heap_top, len) == (uint64)-1) {
             return -1;
         }
     } else if(new_heap_top < old_heap_top) {
-        // 缩减堆
-        uint32 len = old_heap_top - new_heap_top;
-        if(uvm_heap_ungrow(p->pgtbl, new_heap_top, len) < 0) {
+        // 缩减堆: 释放 [new_heap_top, old_heap_top)
+        uint64 len = old_heap_top - new_heap_top;
+        if(uvm_heap_ungrow(p->pgtbl, old_heap_top, len) == (uint64)-1) {
             return -1;
         }
     }
@@ -58,15 +61,19 @@ uint64 sys_brk(void) {
 // 内存映射
 // uint64 start 起始地址 (如果为0则由内核自主选择一个合适的起点)
 // uint32 len   范围(字节, 检查是否是page-aligned)
+// uint32 flags MAP_SHARED: fork后父子进程共享这段内存; 否则是私有映射(其余位保留)
 // 成功返回映射空间的起始地址, 失败返回-1
 uint64 sys_mmap()
 {
     proc_t* p = myproc();
     uint64 start;
     uint32 len;
+    uint32 flags;
     
     arg_uint64(0, &start);
     arg_uint32(1, &len);
+    arg_uint32(2, &flags);
+    flags &= MAP_SHARED;
     
     // 检查长度是否page-aligned
     if(len == 0 || len % PGSIZE != 0) {
@@ -75,42 +82,31 @@ uint64 sys_mmap()
     
     uint32 npages = len / PGSIZE;
     
-    // 如果 start == 0，自动选择一个合适的地址
+    // 如果 start == 0，在mmap区域里自动选择一个合适的地址
     if(start == 0) {
-        uint64 search_start = PG_ROUND_UP(p->heap_top) + PGSIZE;
-        uint64 search_end = TRAPFRAME - p->ustack_pages * PGSIZE - PGSIZE;
-        
-        mmap_region_t* curr = p->mmap;
-        uint64 candidate = search_start;
-        
-        while(curr != NULL) {
-            uint64 curr_end = curr->begin + curr->npages * PGSIZE;
-            
-            if(candidate + len <= curr->begin) {
-                start = candidate;
-                break;
-            }
-            
-            candidate = curr_end;
-            curr = curr->next;
-        }
-        
+        start = mmap_find_gap(p->mmap, len);
         if(start == 0) {
-            if(candidate + len <= search_end) {
-                start = candidate;
-            } else {
-                return -1;
-            }
+            return -1;
         }
     } else {
         if(start % PGSIZE != 0) {
             return -1;
         }
+        // 只能落在mmap区域内: 不能覆盖代码段和堆, 用户栈和更高处的trapframe, 以及内核的全局映射
+        if(start < MMAP_BEGIN || start + len > MMAP_END || !uvm_range_ok(start, start + len)) {
+            return -1;
+        }
+        // 不能覆盖已有的mmap区域
+        if(mmap_overlap(p->mmap, start, start + len)) {
+            return -1;
+        }
     }
     
     // 执行mmap映射
     int perm = PTE_R | PTE_W | PTE_U;
-    uvm_mmap(start, npages, perm);
+    if(uvm_mmap(start, npages, perm, flags) < 0) {
+        return -1;
+    }
     
     return start;
 }
@@ -137,22 +133,104 @@ uint64 sys_munmap()
         printf("sys_munmap: len is zero\n");
         return -1;
     }
-    
+
+    // 只能取消mmap区域里的映射, 不能碰堆 用户栈 trapframe 和内核的全局映射
+    if(start < MMAP_BEGIN || start + len > MMAP_END || !uvm_range_ok(start, start + len)) {
+        return -1;
+    }
+
     uint32 npages = len / PGSIZE;
     
     // 执行munmap
-    uvm_munmap(start, npages);
+    if(uvm_munmap(start, npages) < 0) {
+        return -1;
+    }
     
     return 0;
 }
 
+// 修改内存权限
+// uint64 start 起始地址 (page-aligned)
+// uint32 len   范围(字节, 检查是否是page-aligned)
+// uint32 prot  PROT_READ PROT_WRITE PROT_EXEC 的组合, PROT_NONE 表示不可访问
+// PROT_WRITE 隐含 PROT_READ (硬件不支持只写页面), PROT_EXEC 可以单独使用
+// PROT_NONE 之后访问会出错, 页面内容保留, 恢复权限后可以继续使用
+// 成功返回0 失败返回-1
+uint64 sys_mprotect()
+{
+    uint64 start;
+    uint32 len;
+    uint32 prot;
+
+    arg_uint64(0, &start);
+    arg_uint32(1, &len);
+    arg_uint32(2, &prot);
+
+    if(start % PGSIZE != 0 || len % PGSIZE != 0 || len == 0) {
+        return -1;
+    }
+    if(prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) {
+        return -1;
+    }
+    if(!uvm_range_ok(start, start + len)) {
+        return -1;
+    }
+
+    int perm = 0;
+    if(prot & (PROT_READ | PROT_WRITE))
+        perm |= PTE_R;
+    if(prot & PROT_WRITE)
+        perm |= PTE_W;
+    if(prot & PROT_EXEC)
+        perm |= PTE_X;
+    if(perm != 0)
+        perm |= PTE_U;
+
+    if(uvm_mprotect(start, len / PGSIZE, perm) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// 内存使用建议(只用于mmap区域)
+// uint64 start  起始地址 (page-aligned)
+// uint32 len    范围(字节, 检查是否是page-aligned)
+// uint32 advice MADV_DONTNEED 释放物理页但保留区域
+//               MADV_WILLNEED MADV_POPULATE_READ MADV_POPULATE_WRITE 预先分配页面
+// 成功返回0 失败返回-1
+uint64 sys_madvise()
+{
+    uint64 start;
+    uint32 len;
+    uint32 advice;
+
+    arg_uint64(0, &start);
+    arg_uint32(1, &len);
+    arg_uint32(2, &advice);
+
+    if(start % PGSIZE != 0 || len % PGSIZE != 0 || len == 0) {
+        return -1;
+    }
+    if(!uvm_range_ok(start, start + len)) {
+        return -1;
+    }
+
+    if(uvm_madvise(start, len / PGSIZE, advice) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
 // 打印字符串
 // uint64 addr
 uint64 sys_print()
 {
     char buf[256];
     
-    arg_str(0, buf, sizeof(buf));
+    if(arg_str(0, buf, sizeof(buf)) < 0)
+        return -1;
     
     printf("%s", buf);
     
@@ -190,26 +268,41 @@ uint64 sys_exit()
 extern timer_t sys_timer;
 
 // 进程睡眠一段时间
-// uint32 second 睡眠时间
-// 成功返回0, 失败返回-1
+// uint32 second 睡眠时间(秒)
+// 进程处于SLEEPING状态, 到期后由时钟中断唤醒
+// 成功返回0
 uint64 sys_sleep(void) {
     uint32 second;
     arg_uint32(0, &second);
     
-    // 获取当前 tick
-    uint64 start_tick = timer_get_ticks();
-    // 计算目标 tick（秒数 * 频率）
-    uint64 target_tick = start_tick + second * TIMER_FREQ;
-    
-    // 等待直到达到目标时间
-    while(timer_get_ticks() < target_tick) {
-        // 检查进程是否被杀死
-        if(myproc()->state == ZOMBIE) {
-            return -1;
-        }
-        // 主动让出 CPU
-        proc_yield();
-    }
+    // 截止时间按mtime计算(每秒 TIMER_FREQ 个单位)
+    timer_sleep_until(timer_mtime() + (uint64)second * TIMER_FREQ);
     
     return 0;
-}
\ No newline at end of file
+}
+
+// 进程睡眠一段时间(纳秒)
+// uint64 ns 睡眠时间(纳秒), 实际精度是一个时钟中断间隔, 不会提前醒来
+// 成功返回0
+uint64 sys_nanosleep()
+{
+    uint64 ns;
+    arg_uint64(0, &ns);
+
+    // 向上取整到mtime单位
+    uint64 delta = (ns + TIMER_NS_PER_MTIME - 1) / TIMER_NS_PER_MTIME;
+    timer_sleep_until(timer_mtime() + delta);
+
+    return 0;
+}
+
+// 调整当前进程的nice值
+// int inc 增量(结果限制在 [-20, 19], 越小分到的CPU时间越多)
+// 返回新的nice值
+uint64 sys_nice()
+{
+    uint32 inc;
+
+    arg_uint32(0, &inc);
+    return proc_nice((int)inc);
+}
@@ -4,6 +4,7 @@
 #include "dev/plic.h"
 #include "trap/trap.h"
 #include "proc/cpu.h"
+#include "mem/vmem.h"
 #include "memlayout.h"
 #include "riscv.h"
 
@@ -51,6 +52,40 @@ char* exception_info[16] = {
 // 内核中断处理流程
 extern void kernel_vector();
 
+#if KERNEL_IN_UPGTBL
+
+// in uaccess.S
+extern char uaccess_begin[], uaccess_end[], uaccess_fixup[];
+
+// 异常表: 在 [begin, end) 之间的指令访问用户内存失败时跳转到 fixup
+static struct {
+    uint64 begin;
+    uint64 end;
+    uint64 fixup;
+} ex_table[] = {
+    { (uint64)uaccess_begin, (uint64)uaccess_end, (uint64)uaccess_fixup },
+};
+
+#define NEX_TABLE (sizeof(ex_table) / sizeof(ex_table[0]))
+
+// 内核访问用户内存时发生的异常
+// 能按需分配或写时复制的直接返回重新执行, 否则跳转到fixup
+// 不是访问用户内存引起的返回false
+static bool ex_table_fixup(uint64 sepc, uint64 scause, uint64 stval)
+{
+    for(int i = 0; i < NEX_TABLE; i++) {
+        if(sepc < ex_table[i].begin || sepc >= ex_table[i].end)
+            continue;
+        if((scause == 13 || scause == 15) && uvm_fault(stval, scause == 15) == 0)
+            return true;
+        w_sepc(ex_table[i].fixup);
+        return true;
+    }
+    return false;
+}
+
+#endif
+
 // 初始化trap中全局共享的东西
 void trap_kernel_init()
 {
@@ -99,8 +134,23 @@ void timer_interrupt_handler()
     if(mycpuid() == 0){
         timer_update();
     }
-    // 通过清除SSIP位，承认软件中断
+    // 每个hart处理自己的定时睡眠
+    timer_expire();
+}
+
+// S-mode软件中断处理
+// M-mode把时钟中断和核间中断(TLB shootdown)都转发成SSIP
+// 先清除SSIP位再检查原因, 处理期间新到的中断会重新置位SSIP, 不会丢失
+// 发生过时钟中断返回true
+bool soft_interrupt_handler()
+{
     w_sip(r_sip() & ~2);
+
+    tlb_ipi_handler();
+    if(!timer_tick_fired())
+        return false;
+    timer_interrupt_handler();
+    return true;
 }
 
 // 在kernel_vector()里面调用
@@ -124,7 +174,7 @@ void trap_kernel_handler()
         // 可用于调试的输出测试信息
         switch(trap_id){
             case 1:
-                timer_interrupt_handler();
+                soft_interrupt_handler();
                 break;
             case 9:
                 external_interrupt_handler();
@@ -137,6 +187,11 @@ void trap_kernel_handler()
                 break;
         }
     }
+#if KERNEL_IN_UPGTBL
+    else if(ex_table_fixup(sepc, scause, stval)){
+        // 访问用户内存引起的异常, 已经修复
+    }
+#endif
     else{
         // 异常
         // 可用于调试的输出测试信息
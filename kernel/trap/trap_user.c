@@ -60,8 +60,9 @@ void trap_user_handler()
         switch (trap_id)
         {
         case 1:
-            // 处理时钟中断
-            timer_interrupt_handler();
+            // 处理时钟中断和核间中断, 时钟中断时计算时间片(可能被抢占)
+            if(soft_interrupt_handler())
+                proc_tick();
             break;
         case 5:
             // 处理计时器中断
@@ -79,14 +80,15 @@ void trap_user_handler()
             panic("usertrap: unexpected interrupt");
             break;
         }
+    } else if((scause == 12 || scause == 13 || scause == 15) && uvm_fault(stval, scause == 15) == 0) {
+        // instruction/load/store page fault: 按需分配页面 或 写时复制页面第一次写入
     } else {
-        // 异常处理
+        // 异常处理: 非法访问的进程直接退出
         printf("usertrap(): exception at pid=%d\n", p->pid);
         printf("            trap id: %d trap info: %s\n", trap_id, info);
         printf("            scause %p\n", scause);
         printf("            sepc=%p stval=%p\n", sepc, stval);
-        panic("usertrap: unexpected exception");
-        // setkilled(p);
+        proc_exit(-1);
     }
 
     trap_user_return();
@@ -118,8 +120,14 @@ void trap_user_return()
     // set S Exception Program Counter to the saved user pc.
     w_sepc(p->tf->epc);
 
+#if KERNEL_IN_UPGTBL
+    // 进程调度时已经切换到了用户页表
+    uint64 satp = r_satp();
+#else
     // tell trampoline.S the user page table to switch to.
-    uint64 satp = MAKE_SATP(p->pgtbl);
+    // 顺便确认ASID有效并完成需要的TLB刷新
+    uint64 satp = asid_switch(p);
+#endif
 
     uint64 trampoline_userret = TRAMPOLINE + (user_return - trampoline);
     ((void (*)(uint64, uint64))trampoline_userret)(TRAPFRAME, satp);
@@ -13,7 +13,7 @@ int main()
     syscall(SYS_print, "\nuser begin\n");
 
     // 测试MMAP区域
-    str1 = (char*)syscall(SYS_mmap, MMAP_BEGIN, PGSIZE);
+    str1 = (char*)syscall(SYS_mmap, MMAP_BEGIN, PGSIZE, MAP_PRIVATE);
     
     // 测试HEAP区域
     long long top = syscall(SYS_brk, 0);
@@ -27,4 +27,21 @@ typedef long syscall_arg_t;
 #define __syscall(...) __SYSCALL_DISP(__syscall, __VA_ARGS__)
 #define syscall(...) __syscall(__VA_ARGS__)
 
+// SYS_mmap 的第三个参数
+#define MAP_PRIVATE 0x0 // 私有映射(fork后写时复制)
+#define MAP_SHARED  0x1 // 共享映射(fork后父子进程共享同一组物理页)
+
+// SYS_mprotect 的第三个参数
+#define PROT_NONE   0x0 // 不可访问(页面内容保留)
+#define PROT_READ   0x1
+#define PROT_WRITE  0x2 // 隐含 PROT_READ
+#define PROT_EXEC   0x4
+
+// SYS_madvise 的第三个参数
+#define MADV_NORMAL         0
+#define MADV_WILLNEED       3  // 预先分配页面
+#define MADV_DONTNEED       4  // 释放物理页, 保留区域, 再次访问得到清零的页面
+#define MADV_POPULATE_READ  22 // 预先分配页面
+#define MADV_POPULATE_WRITE 23 // 预先分配页面, 写时复制的页面也复制好
+
 #endif // __SYSCALL_H
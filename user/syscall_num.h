@@ -9,5 +9,9 @@
 #define SYS_wait         5
 #define SYS_exit         6
 #define SYS_sleep        7
+#define SYS_mprotect     8
+#define SYS_madvise      9
+#define SYS_nice         10
+#define SYS_nanosleep    11
 
 #endif
\ No newline at end of file
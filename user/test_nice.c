@@ -0,0 +1,76 @@
+#include "sys.h"
+
+// nice值测试: CPU时间应该按权重分配
+// 两个子进程一直做加法, 一个 nice 0 (权重1024), 一个 nice 5 (权重335), 理论比例约 3.06
+// 多核时两个进程可能各占一个hart, 请在单核上运行:
+//   make -C user init PROG=test_nice && make clean && make qemu CPUNUM=1
+
+#define PGSIZE      4096
+#define RUN_NS      5000000000ul   // 父进程睡眠5秒, 期间子进程竞争CPU
+
+struct shared {
+    volatile int stop;
+    volatile unsigned long count[2];
+};
+
+static void print_num(unsigned long n);
+static void worker(struct shared* sh, int idx, int nice);
+
+// main必须是文件里的第一个函数: 程序被当作二进制从地址0开始执行
+int main()
+{
+    struct shared* sh = (struct shared*)syscall(SYS_mmap, 0, PGSIZE, MAP_SHARED);
+    if((long)sh == -1) {
+        syscall(SYS_print, "test_nice: mmap failed\n");
+        while(1);
+    }
+    sh->stop = 0;
+    sh->count[0] = sh->count[1] = 0;
+
+    if(syscall(SYS_fork) == 0)
+        worker(sh, 0, 0);
+    if(syscall(SYS_fork) == 0)
+        worker(sh, 1, 5);
+
+    syscall(SYS_nanosleep, RUN_NS);
+    sh->stop = 1;
+    syscall(SYS_wait, 0);
+    syscall(SYS_wait, 0);
+
+    syscall(SYS_print, "test_nice: nice 0 count = ");
+    print_num(sh->count[0]);
+    syscall(SYS_print, ", nice 5 count = ");
+    print_num(sh->count[1]);
+    syscall(SYS_print, "\n");
+
+    // 比例在 [2, 4.5] 之内算通过(每秒只有10个时间片, 误差比较大)
+    unsigned long a = sh->count[0], b = sh->count[1];
+    if(b > 0 && a >= 2 * b && 2 * a <= 9 * b)
+        syscall(SYS_print, "test_nice: PASS\n");
+    else
+        syscall(SYS_print, "test_nice: FAIL\n");
+
+    while(1);
+    return 0;
+}
+
+static void print_num(unsigned long n)
+{
+    char buf[24];
+    int i = sizeof(buf) - 1;
+
+    buf[i] = '\0';
+    do {
+        buf[--i] = '0' + n % 10;
+        n /= 10;
+    } while(n > 0);
+    syscall(SYS_print, &buf[i]);
+}
+
+static void worker(struct shared* sh, int idx, int nice)
+{
+    syscall(SYS_nice, nice);
+    while(!sh->stop)
+        sh->count[idx]++;
+    syscall(SYS_exit, 0);
+}